@@ -6,15 +6,23 @@ from __future__ import print_function
 lib_src  = [
   'text',
   'ast',
+  'astflat',
+  'astcache',
+  'hash',
   'readfile',
+  'srcloc',
   'langconst',
   'istr',
   'strtoint',
   'types',
   'lex',
+  'tokstream',
+  'depscan',
   'parse',
+  'build',
   'mod',
   'wasm',
+  'server',
 ]
 
 from optparse import OptionParser
@@ -35,6 +43,9 @@ parser.add_option('--host',
                   choices=platform_helper.platforms())
 parser.add_option('--debug', action='store_true',
                   help='enable debugging extras',)
+parser.add_option('--istr-arena', action='store_true',
+                  help='allocate interned strings from an arena and never free them '
+                       '(no reference counting of strings)',)
 parser.add_option('--force-pselect', action='store_true',
                   help='ppoll() is used by default where available, '
                        'but some platforms may need to use pselect instead',)
@@ -53,6 +64,8 @@ else:
 
 # lib_h    = ['parse']
 main_src = ['cox']
+bench_src = ['bench_category', 'bench_hash'] # in misc/
+check_src = ['check_astflat', 'check_reparse'] # in misc/
 
 BUILD_FILENAME = 'build.ninja'
 buildfile = open(BUILD_FILENAME, 'w')
@@ -134,8 +147,11 @@ else:
               '-fvisibility=hidden', '-pipe',
               '-Wno-missing-field-initializers',
               '-Wno-unused-variable',
+              '-pthread',
               '-Ideps/dist/include']
               # '-DNINJA_PYTHON="%s"' % options.with_python
+    if options.istr_arena:
+        cflags += ['-DRX_ISTR_ARENA=1']
     if options.debug:
         cflags += ['-D_GLIBCXX_DEBUG', '-D_GLIBCXX_DEBUG_PEDANTIC', '-DDEBUG=1']
         cflags.remove('-fno-rtti')  # Needed for above pedanticness.
@@ -146,7 +162,7 @@ else:
         cflags += ['-fcolor-diagnostics']
     if platform.is_mingw():
         cflags += ['-D_WIN32_WINNT=0x0501']
-    ldflags = ['-lc++', '-L$builddir/lib']
+    ldflags = ['-lc++', '-pthread', '-L$builddir/lib']
 
 libs = []
 # libs = ['-Ldeps/dist/lib', '-lboost_context', '-lboost_thread']
@@ -286,6 +302,28 @@ cox = n.build(binary('cox'), 'link', objs, implicit=cox_lib,
 n.newline()
 all_targets += cox
 
+def misc_programs(names):
+    targets = []
+    for name in names:
+        objs = n.build(built(os.path.join('obj', name + objext)), 'cxx',
+                       os.path.join('misc', name + '.cc'),
+                       variables=[('cflags', '$cflags -Isrc')])
+        targets += n.build(binary(name), 'link', objs, implicit=cox_lib,
+                           variables=[('libs', libs)])
+    return targets
+
+n.comment('Microbenchmarks, built with "ninja bench".')
+bench_targets = misc_programs(bench_src)
+n.build('bench', 'phony', bench_targets)
+n.newline()
+all_targets += bench_targets
+
+n.comment('Consistency checks, built with "ninja check".')
+check_targets = misc_programs(check_src)
+n.build('check', 'phony', check_targets)
+n.newline()
+all_targets += check_targets
+
 # n.comment('Tests all build into ninja_test executable.')
 
 # variables = []
@@ -0,0 +1,121 @@
+// Compares text::category with the lookup it replaced: a flat map of the BMP
+// plus a switch over the invalid ranges past it.
+//
+//   ninja bench && build/bin/bench_category [reps]
+//
+#include "text.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+using text::Category;
+
+#include "text.def"
+
+namespace old {
+
+static Category kCharCategoryMap[RX_TEXT_CHAR_MAP_SIZE] = {
+  #define CP(cp, Cat, Bidir, namestr)  (Category)RX_TEXT_CHAR_CAT_##Cat,
+  RX_TEXT_CHAR_MAP(CP)
+  #undef CP
+};
+
+static Category category(UChar c) {
+  if (c < RX_TEXT_CHAR_MAP_SIZE) {
+    return kCharCategoryMap[c];
+  } else {
+    switch (c) {
+      #define CP(cp)           case cp:
+      #define CR(StartC, EndC) case StartC ... EndC:
+      RX_TEXT_INVALID_MAP_ADDITION_RANGES(CP,CR)
+      #undef CP
+      #undef CR
+        return Category::Unassigned;
+      default:
+        return c <= RX_TEXT_LAST_VALID_CHAR ? Category::Assigned : Category::Unassigned;
+    }
+  }
+}
+
+} // namespace old
+
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rand32() {
+  // xorshift64*, so that inputs are the same on every run
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return uint32_t((rngState * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+
+// Characters as the lexer sees them: mostly ASCII, some Latin-1 and other
+// BMP letters in identifiers and strings, now and then an emoji
+static std::vector<UChar> sourceChars(size_t n) {
+  std::vector<UChar> v(n);
+  for (auto& c : v) {
+    uint32_t r = rand32() % 1000;
+    c = r < 950 ? 0x20 + rand32() % 0x5F :
+        r < 990 ? 0xA0 + rand32() % 0x2000 :
+        r < 998 ? 0x2000 + rand32() % 0xE000 :
+                  0x1F300 + rand32() % 0x300;
+  }
+  return v;
+}
+
+static std::vector<UChar> uniformChars(size_t n, UChar limit) {
+  std::vector<UChar> v(n);
+  for (auto& c : v) {
+    c = rand32() % limit;
+  }
+  return v;
+}
+
+
+volatile unsigned sink; // keeps results alive
+
+template <typename F>
+static double nsPerChar(const std::vector<UChar>& input, int reps, F category) {
+  unsigned sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r != reps; ++r) {
+    for (auto c : input) {
+      sum += (unsigned)category(c);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  sink = sum;
+  double ns = std::chrono::duration<double,std::nano>(end - start).count();
+  return ns / (double(input.size()) * reps);
+}
+
+
+int main(int argc, const char* argv[]) {
+  int reps = argc > 1 ? atoi(argv[1]) : 20;
+
+  // Both must agree on every codepoint, and a bit beyond
+  for (UChar c = 0; c != 0x110100; ++c) {
+    if (old::category(c) != text::category(c)) {
+      fprintf(stderr, "mismatch at U+%04X: old %u, new %u\n", c,
+              (unsigned)old::category(c), (unsigned)text::category(c));
+      return 1;
+    }
+  }
+
+  const size_t n = 1 << 20;
+  struct { const char* name; std::vector<UChar> input; } inputs[] = {
+    {"source-like", sourceChars(n)},
+    {"uniform BMP", uniformChars(n, 0x10000)},
+    {"uniform all", uniformChars(n, 0x110000)},
+  };
+  printf("%-12s %10s %10s\n", "input", "old ns/c", "new ns/c");
+  for (auto& in : inputs) {
+    double o = nsPerChar(in.input, reps, old::category);
+    double t = nsPerChar(in.input, reps, text::category);
+    printf("%-12s %10.3f %10.3f\n", in.name, o, t);
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Compares the speed and distribution of hash::wyhash32, which IStr uses,
+// with hash::fnv1a32, which it used before.
+//
+//   ninja bench && build/bin/bench_hash [reps]
+//
+#include "hash.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ull;
+
+static uint32_t rand32() {
+  // xorshift64*, so that inputs are the same on every run
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return uint32_t((rngState * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+// Identifier-like string of len bytes, e.g. "xq_3bT"
+static std::string ident(size_t len) {
+  static const char chars[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+  std::string s(len, ' ');
+  for (size_t i = 0; i != len; ++i) {
+    s[i] = chars[rand32() % (i == 0 ? 53 : sizeof(chars) - 1)];
+  }
+  return s;
+}
+
+// Lengths of identifiers in typical source: mostly 1-12 bytes
+static size_t identLen() {
+  static const uint8_t lens[] = {1,1,2,2,3,3,3,4,4,4,5,5,5,6,6,6,7,7,8,8,9,10,11,12,14,16,20,24};
+  return lens[rand32() % sizeof(lens)];
+}
+
+
+volatile uint32_t sink; // keeps results alive
+
+// Best of 5 runs, to filter out noise from other processes
+template <typename F>
+static double nsPerHash(const std::vector<std::string>& keys, int reps, F hash) {
+  double best = 1e30;
+  for (int run = 0; run != 5; ++run) {
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r != reps; ++r) {
+      for (auto& k : keys) {
+        sum += hash(k.data(), k.size());
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = sum;
+    double ns = std::chrono::duration<double,std::nano>(end - start).count();
+    best = std::min(best, ns / (double(keys.size()) * reps));
+  }
+  return best;
+}
+
+// Lambdas rather than functions so that hashes are inlined, as in IStr
+static auto wyhash32 = [](const char* p, size_t len) { return hash::wyhash32(p, len); };
+static auto fnv1a32 = [](const char* p, size_t len) { return hash::fnv1a32(p, len); };
+
+
+// Distribution of hashes of keys: full 32-bit collisions, and how evenly
+// buckets of the top 6 bits (the IStr::SharedSet shard) and of the low 10
+// bits (a hash table index) are filled, as a chi-squared statistic divided
+// by its degrees of freedom. That ratio is close to 1 for a good hash.
+template <typename F>
+static void distribution(const char* name, const std::vector<std::string>& keys, F hash) {
+  std::unordered_set<uint32_t> seen;
+  std::vector<size_t> top(64), low(1024);
+  size_t collisions = 0;
+  for (auto& k : keys) {
+    uint32_t h = hash(k.data(), k.size());
+    collisions += !seen.insert(h).second;
+    ++top[h >> 26];
+    ++low[h & 1023];
+  }
+  auto chi2 = [&](const std::vector<size_t>& buckets) {
+    double expect = double(keys.size()) / buckets.size();
+    double x = 0;
+    for (auto n : buckets) {
+      x += (n - expect) * (n - expect) / expect;
+    }
+    return x / double(buckets.size() - 1);
+  };
+  double expected = double(keys.size()) * double(keys.size() - 1) / 2 / 4294967296.0;
+  printf("%-8s %10zu %10.0f %10.2f %10.2f\n", name, collisions, expected, chi2(top), chi2(low));
+}
+
+
+int main(int argc, const char* argv[]) {
+  int reps = argc > 1 ? atoi(argv[1]) : 20;
+
+  printf("%-8s %10s %10s\n", "len", "wyhash", "fnv1a");
+  for (size_t len : {1, 3, 5, 8, 12, 16, 24, 40, 100}) {
+    std::vector<std::string> keys(4096);
+    for (auto& k : keys) {
+      k = ident(len);
+    }
+    printf("%-8zu %10.2f %10.2f\n", len,
+           nsPerHash(keys, reps * 10, wyhash32), nsPerHash(keys, reps * 10, fnv1a32));
+  }
+  std::vector<std::string> mixed(1 << 16);
+  for (auto& k : mixed) {
+    k = ident(identLen());
+  }
+  printf("%-8s %10.2f %10.2f  (ns/hash)\n\n", "mixed",
+         nsPerHash(mixed, reps * 4, wyhash32), nsPerHash(mixed, reps * 4, fnv1a32));
+
+  // Distinct identifier-like keys: of typical lengths, and of at most 8
+  // bytes, which take the short path of wyhash
+  for (size_t maxlen : {size_t(0), size_t(8)}) {
+    std::unordered_set<std::string> uniq;
+    while (uniq.size() < 600000) {
+      uniq.insert(maxlen == 0 ? ident(identLen() + 2) : ident(3 + rand32() % (maxlen - 2)));
+    }
+    std::vector<std::string> keys(uniq.begin(), uniq.end());
+    printf("%-8s %10s %10s %10s %10s\n", maxlen == 0 ? "typical" : "short",
+           "collide", "expected", "top6 x2", "low10 x2");
+    distribution("wyhash", keys, wyhash32);
+    distribution("fnv1a", keys, fnv1a32);
+  }
+  return 0;
+}
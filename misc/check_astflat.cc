@@ -0,0 +1,76 @@
+// Checks that an AstFlat built from a parsed program describes the same tree
+// as the program, by comparing ast_repr of both, and that moving an AstFlat
+// leaves both sides valid.
+//
+//   ninja check && build/bin/check_astflat misc/in0.co [file ...]
+//
+#include "build.h"
+#include "astflat.h"
+#include <sstream>
+#include <stdio.h>
+
+static std::string repr(AstNode& n) {
+  std::ostringstream ss;
+  ast_repr(n, ss);
+  return ss.str();
+}
+
+static std::string repr(AstRef n) {
+  std::ostringstream ss;
+  ast_repr(n, ss);
+  return ss.str();
+}
+
+// Prints the line where a and b first differ
+static void printDiff(const std::string& a, const std::string& b) {
+  size_t i = 0;
+  while (i != a.size() && i != b.size() && a[i] == b[i]) {
+    ++i;
+  }
+  size_t start = a.rfind('\n', i);
+  start = start == std::string::npos ? 0 : start + 1;
+  fprintf(stderr, "  tree: %s\n  flat: %s\n",
+          a.substr(start, a.find('\n', i) - start).c_str(),
+          b.substr(start, b.find('\n', i) - start).c_str());
+}
+
+static bool check(const char* filename, IStr::SharedSet& strings) {
+  build::Unit u;
+  build::parseUnit(u, filename, strings);
+  if (u.err) {
+    fprintf(stderr, "%s: %s\n", filename, u.err.message());
+    return false;
+  }
+
+  std::string want = repr(*u.prog);
+  AstFlat flat = AstFlat::fromTree(*u.prog);
+  std::string got = repr(flat.root());
+  if (got != want) {
+    fprintf(stderr, "%s: AstFlat differs from the tree\n", filename);
+    printDiff(want, got);
+    return false;
+  }
+
+  // Move into a flat which already holds nodes and strings
+  AstFlat other = AstFlat::fromTree(*u.prog);
+  other = std::move(flat);
+  if (repr(other.root()) != want || flat.size() != 0 || flat.root()) {
+    fprintf(stderr, "%s: AstFlat is wrong after move\n", filename);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file ...\n", argv[0]);
+    return 2;
+  }
+  IStr::SharedSet strings;
+  int failed = 0;
+  for (int i = 1; i != argc; ++i) {
+    failed += !check(argv[i], strings);
+  }
+  printf("%d of %d files ok\n", argc - 1 - failed, argc - 1);
+  return failed != 0;
+}
@@ -0,0 +1,295 @@
+// Checks Parser::reparseProgram against parseProgram. Scripted edits are
+// made to each file: declarations are changed, inserted (also where the
+// imports end), duplicated and removed, and text is appended. After each edit
+// the program as reparsed must have the same ast_repr, SrcLocs and DeclSpans
+// as a fresh parse of the new source, and when that parse fails, so must the
+// reparse, leaving the program as it was. An import added after the imports
+// must ask for a full parse, and invalid UTF-8 must fail with
+// ParseErrEncoding at the bad byte.
+//
+//   ninja check && build/bin/check_reparse misc/in0.co [file ...]
+//
+#include "build.h"
+#include "parse.h"
+#include <algorithm>
+#include <sstream>
+#include <stdio.h>
+
+// A program parsed in full
+struct Parsed {
+  Module       mod;
+  AstAllocator astalloc;
+  AstNode*     prog = nullptr;
+  DeclSpans    spans;
+  Err          err;
+
+  Parsed(const std::string& src, IStr::SharedSet& strings) {
+    Parser p(src.data(), src.size(), strings, mod);
+    AstPkgDecl pkgdecl;
+    Imports imps;
+    prog = astalloc.alloc();
+    prog->type = AstProgram;
+    err = p.parsePkgDecl(pkgdecl);
+    if (!err) { err = p.parseImports(astalloc, imps); }
+    if (!err) { err = p.parseProgram(astalloc, *prog, &spans); }
+  }
+};
+
+// One scripted change to a source
+struct Edit {
+  SrcEdit     edit;
+  std::string text; // newLength bytes replacing the old ones
+};
+
+enum Expect {
+  ExpectSame,      // same as a full parse of the new source
+  ExpectFullParse, // result.needFullParse
+  ExpectEncoding,  // ParseErrEncoding at badOffset in the new source
+};
+
+static std::string repr(AstNode& n) {
+  std::ostringstream ss;
+  ast_repr(n, ss);
+  return ss.str();
+}
+
+// Prints the line where a and b first differ
+static void printDiff(const std::string& a, const std::string& b) {
+  size_t i = 0;
+  while (i != a.size() && i != b.size() && a[i] == b[i]) {
+    ++i;
+  }
+  size_t start = a.rfind('\n', i);
+  start = start == std::string::npos ? 0 : start + 1;
+  fprintf(stderr, "  reparsed: %s\n  parsed:   %s\n",
+          a.substr(start, a.find('\n', i) - start).c_str(),
+          b.substr(start, b.find('\n', i) - start).c_str());
+}
+
+static bool sameLoc(const SrcLoc& a, const SrcLoc& b) {
+  return a.offset == b.offset && a.length == b.length;
+}
+
+static bool sameLocs(const AstNode* a, const AstNode* b) {
+  for (; a != nullptr && b != nullptr; a = a->nextSib, b = b->nextSib) {
+    if (a->type != b->type || !sameLoc(a->loc, b->loc) ||
+        !sameLocs(a->children.first, b->children.first)) {
+      return false;
+    }
+  }
+  return a == b;
+}
+
+static bool sameSpans(const DeclSpans& a, const DeclSpans& b) {
+  if (a.begin != b.begin || a.end != b.end || a.decls.size() != b.decls.size()) {
+    return false;
+  }
+  for (size_t i = 0; i != a.decls.size(); ++i) {
+    if (!sameLoc(a.decls[i], b.decls[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::string applyEdits(const std::string& src, const std::vector<Edit>& edits) {
+  std::string s;
+  size_t pos = 0;
+  for (auto& e : edits) {
+    s.append(src, pos, e.edit.offset - pos);
+    s += e.text;
+    pos = e.edit.offset + e.edit.length;
+  }
+  s.append(src, pos, std::string::npos);
+  return s;
+}
+
+static Edit insertAt(uint32_t offset, const std::string& text) {
+  return {{offset, 0, (uint32_t)text.size()}, text};
+}
+
+// Reparses src with `edits` applied and checks the result. Returns false
+// and prints why if it is not as expected.
+static bool checkEdit(const char* filename, const char* what,
+                      const std::string& src, IStr::SharedSet& strings,
+                      const std::vector<Edit>& edits, Expect expect,
+                      uint32_t badOffset = 0)
+{
+  Parsed old(src, strings);
+  std::string oldRepr = repr(*old.prog);
+  DeclSpans oldSpans = old.spans;
+
+  std::string nsrc = applyEdits(src, edits);
+  std::vector<SrcEdit> srcEdits;
+  for (auto& e : edits) {
+    srcEdits.push_back(e.edit);
+  }
+  ReparseResult result;
+  SrcLoc errloc;
+  Err err = Parser::reparseProgram(nsrc.data(), nsrc.size(), strings, old.mod,
+                                   old.astalloc, *old.prog, old.spans, srcEdits,
+                                   result, errloc);
+
+  auto unchanged = [&] {
+    return repr(*old.prog) == oldRepr && sameSpans(old.spans, oldSpans);
+  };
+  const char* problem = nullptr;
+
+  if (expect == ExpectFullParse) {
+    if (!result.needFullParse) {
+      problem = "no full parse was asked for";
+    } else if (!unchanged()) {
+      problem = "the program changed although a full parse was asked for";
+    }
+  } else if (result.needFullParse) {
+    problem = "a full parse was asked for";
+  } else if (expect == ExpectEncoding) {
+    if (err.code() != ParseErrEncoding) {
+      problem = "no encoding error";
+    } else if (errloc.offset != badOffset) {
+      problem = "the encoding error is at the wrong offset";
+    } else if (!unchanged()) {
+      problem = "the program changed on error";
+    }
+  } else {
+    Parsed want(nsrc, strings);
+    if (want.err) {
+      if (!err) {
+        problem = "a full parse fails but the reparse does not";
+      } else if (!unchanged()) {
+        problem = "the program changed on error";
+      }
+    } else if (err) {
+      fprintf(stderr, "%s: %s: %s\n", filename, what, err.message());
+      problem = "the reparse fails but a full parse does not";
+    } else if (repr(*old.prog) != repr(*want.prog)) {
+      printDiff(repr(*old.prog), repr(*want.prog));
+      problem = "the AST differs from a full parse";
+    } else if (!sameLocs(old.prog, want.prog)) {
+      problem = "the SrcLocs differ from a full parse";
+    } else if (!sameSpans(old.spans, want.spans)) {
+      problem = "the DeclSpans differ from a full parse";
+    }
+  }
+
+  if (problem) {
+    fprintf(stderr, "%s: %s: %s\n", filename, what, problem);
+    return false;
+  }
+  return true;
+}
+
+static bool check(const char* filename, IStr::SharedSet& strings) {
+  build::SrcFile f;
+  if (auto err = f.load(filename)) {
+    fprintf(stderr, "%s: %s\n", filename, err.message());
+    return false;
+  }
+  std::string src(f.p, f.size);
+  Parsed orig(src, strings);
+  if (orig.err) {
+    fprintf(stderr, "%s: %s\n", filename, orig.err.message());
+    return false;
+  }
+  const DeclSpans& spans = orig.spans;
+  const std::string decl = "\nconst reparse__ = 1\n";
+  bool ok = true;
+
+  std::vector<const AstNode*> nodes;
+  for (auto n = orig.prog->children.first; n != nullptr; n = n->nextSib) {
+    nodes.push_back(n);
+  }
+
+  // Edit every declaration of small files, and about 16 spread over bigger
+  // ones, as each edit costs a couple of full parses
+  size_t ndecls = spans.decls.size();
+  size_t step = std::max<size_t>(1, ndecls / 16);
+  std::vector<size_t> picked;
+  for (size_t i = 0; i < ndecls; i += step) {
+    picked.push_back(i);
+  }
+  if (ndecls != 0 && picked.back() != ndecls - 1) {
+    picked.push_back(ndecls - 1);
+  }
+
+  for (size_t i : picked) {
+    const SrcLoc& d = spans.decls[i];
+    uint32_t end = d.offset + d.length;
+    std::string text = src.substr(d.offset, d.length);
+    char what[64];
+
+    snprintf(what, sizeof(what), "indent decl %zu", i);
+    ok &= checkEdit(filename, what, src, strings,
+                    {insertAt(nodes[i]->loc.offset, "  ")}, ExpectSame);
+
+    snprintf(what, sizeof(what), "insert before decl %zu", i);
+    ok &= checkEdit(filename, what, src, strings, {insertAt(d.offset, decl)},
+                    ExpectSame);
+
+    snprintf(what, sizeof(what), "duplicate decl %zu", i);
+    ok &= checkEdit(filename, what, src, strings, {insertAt(end, "\n" + text)},
+                    ExpectSame);
+
+    snprintf(what, sizeof(what), "remove decl %zu", i);
+    ok &= checkEdit(filename, what, src, strings, {{{d.offset, d.length, 0}, ""}},
+                    ExpectSame);
+
+    // Edits far apart which leave the declarations between them alone
+    if (i > 1) {
+      snprintf(what, sizeof(what), "indent decls 0 and %zu", i);
+      ok &= checkEdit(filename, what, src, strings,
+                      {insertAt(nodes[0]->loc.offset, "  "),
+                       insertAt(nodes[i]->loc.offset, "  ")}, ExpectSame);
+    }
+
+    // Edited declarations are checked to be UTF-8 before they are lexed
+    snprintf(what, sizeof(what), "invalid UTF-8 in decl %zu", i);
+    ok &= checkEdit(filename, what, src, strings,
+                    {insertAt(nodes[i]->loc.offset, "// \xff\n")},
+                    ExpectEncoding, nodes[i]->loc.offset + 3);
+  }
+
+  // Text inserted right where the imports end moves the first declaration
+  ok &= checkEdit(filename, "insert at the end of imports", src, strings,
+                  {insertAt(spans.begin, decl)}, ExpectSame);
+  ok &= checkEdit(filename, "comment at the end of imports", src, strings,
+                  {insertAt(spans.begin, "// reparse\n\n")}, ExpectSame);
+  ok &= checkEdit(filename, "remove all decls", src, strings,
+                  {{{spans.begin, spans.end - spans.begin, 0}, ""}}, ExpectSame);
+  ok &= checkEdit(filename, "append", src, strings, {insertAt(spans.end, decl)},
+                  ExpectSame);
+
+  // Imports added after the imports, or edits to the package clause, can't
+  // be reparsed. An import further down is an error.
+  ok &= checkEdit(filename, "import at the end of imports", src, strings,
+                  {insertAt(spans.begin, "import \"reparse__\"\n")},
+                  ExpectFullParse);
+  ok &= checkEdit(filename, "import after a comment at the end of imports", src,
+                  strings, {insertAt(spans.begin, "// reparse\nimport \"reparse__\"\n")},
+                  ExpectFullParse);
+  if (spans.decls.size() > 1) {
+    ok &= checkEdit(filename, "import before decl 1", src, strings,
+                    {insertAt(spans.decls[1].offset, "import \"reparse__\"\n")},
+                    ExpectSame);
+  }
+  ok &= checkEdit(filename, "edit package clause", src, strings,
+                  {insertAt(0, " ")}, ExpectFullParse);
+
+  ok &= checkEdit(filename, "truncated UTF-8 at the end", src, strings,
+                  {insertAt(spans.end, "\n// \xe2")}, ExpectEncoding, spans.end + 4);
+  return ok;
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file ...\n", argv[0]);
+    return 2;
+  }
+  IStr::SharedSet strings;
+  int failed = 0;
+  for (int i = 1; i != argc; ++i) {
+    failed += !check(argv[i], strings);
+  }
+  printf("%d of %d files ok\n", argc - 1 - failed, argc - 1);
+  return failed != 0;
+}
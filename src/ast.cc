@@ -1,5 +1,7 @@
 #include "ast.h"
-#include "freelist.h"
+#include "astflat.h"
+#include <string.h>
+#include <stdlib.h>
 
 const std::string& ast_typename(AstType t) {
   using std::string;
@@ -17,29 +19,60 @@ const std::string& ast_typename(AstType t) {
 static const char kSpaces[] = "                                                  ";
 
 
-static std::ostream& ast_reprchild(AstNode& n, std::ostream& os, uint32_t depth) {
-  for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
-    os << "\n";
-    ast_repr(*cn, os, depth);
+// ast_repr works on both AstNode trees and AstFlat nodes through a view with
+// the same interface as AstRef.
+struct AstNodeView {
+  const AstNode& n;
+  AstType     type() const { return n.type; }
+  uint64_t    intValue() const { return n.value.i; }
+  double      floatValue() const { return n.value.f; }
+  const IStr& strValue() const { return n.value.str; }
+  const Type* ty() const { return n.ty; }
+};
+
+template <typename F> static void forEachChild(AstNodeView v, F f) {
+  for (auto cn = v.n.children.first; cn != nullptr; cn = cn->nextSib) {
+    f(AstNodeView{*cn});
+  }
+}
+
+template <typename F> static void forEachChild(AstRef n, F f) {
+  for (auto cn : n.children()) {
+    f(cn);
   }
+}
+
+
+template <typename Node>
+static std::ostream& repr(Node n, std::ostream& os, uint32_t depth);
+
+
+template <typename Node>
+static std::ostream& ast_reprchild(Node n, std::ostream& os, uint32_t depth) {
+  forEachChild(n, [&](Node cn) {
+    os << "\n";
+    repr(cn, os, depth);
+  });
   return os;
 }
 
 
-static std::ostream& repr_ty(AstNode& n, std::ostream& os, uint32_t depth) {
-  if (n.ty != nullptr) {
-    os << '<' << n.ty->repr(depth) << '>';
+template <typename Node>
+static std::ostream& repr_ty(Node n, std::ostream& os, uint32_t depth) {
+  if (n.ty() != nullptr) {
+    os << '<' << n.ty()->repr(depth) << '>';
   }
   return os;
 }
 
 
-std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
+template <typename Node>
+static std::ostream& repr(Node n, std::ostream& os, uint32_t depth) {
   if (depth > 1000) {
     return os << "[AST REPR DEPTH LIMIT]";
   }
 
-  if (n.type == AstNone) {
+  if (n.type() == AstNone) {
     return os;
   }
 
@@ -52,7 +85,7 @@ std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
 
   repr_ty(n, os, depth);
 
-  switch (n.type) {
+  switch (n.type()) {
 
     // no value, with children
     case AstBlock:
@@ -61,14 +94,14 @@ std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
     case AstPointerType:
     case AstConstDecl:
     case AstTypeDecl: {
-      os << '(' << ast_typename(n.type);
+      os << '(' << ast_typename(n.type());
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
     // with int value =typed?, with children
     case AstConstSpec: {
-      os << '(' << ast_typename(n.type);
-      if (n.value.i > 0xffffffff) {
+      os << '(' << ast_typename(n.type());
+      if (n.intValue() > 0xffffffff) {
         os << " typed";
       } else {
         os << "";
@@ -78,19 +111,19 @@ std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
 
     // with int value =isRest?, with children
     case AstParamDecl: {
-      os << '(' << ast_typename(n.type) << (n.value.i ? " ..." : "");
+      os << '(' << ast_typename(n.type()) << (n.intValue() ? " ..." : "");
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
     // with int value, with children
     case AstFuncSig: {
-      os << '(' << ast_typename(n.type) << ' ' << n.value.i;
+      os << '(' << ast_typename(n.type()) << ' ' << n.intValue();
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
     // with int value =isPointer?, with children
     case AstFieldDecl: {
-      os << '(' << ast_typename(n.type) << (n.value.i ? "*" : "");
+      os << '(' << ast_typename(n.type()) << (n.intValue() ? "*" : "");
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
@@ -99,39 +132,44 @@ std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
     case AstMethodDecl:
     case AstQualIdent:
     case AstTypeSpec: {
-      os << '(' << ast_typename(n.type) << ' ' << n.value.str;
+      os << '(' << ast_typename(n.type()) << ' ' << n.strValue();
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
     // with int value =bool, no children
     case AstBool: {
-      return os << (n.value.i ? "(Bool true)" : "(Bool false)");
+      return os << (n.intValue() ? "(Bool true)" : "(Bool false)");
     }
 
     // with int value =uint64, no children
     case AstIntConst: {
-      return os << "(IntConst " << n.value.i << ')';
+      return os << "(IntConst " << n.intValue() << ')';
+    }
+
+    // with float value =double, no children
+    case AstFloatConst: {
+      return os << "(FloatConst " << n.floatValue() << ')';
     }
 
     // with string value, no children
     case AstIdent: {
-      return os << '(' << ast_typename(n.type) << ' ' << n.value.str << ')';
+      return os << '(' << ast_typename(n.type()) << ' ' << n.strValue() << ')';
     }
 
     // with string text value, no children
     case AstString: {
-      return os << '(' << ast_typename(n.type) << " \""
-                << text::repr(n.value.str.data(), n.value.str.size()) << "\")";
+      return os << '(' << ast_typename(n.type()) << " \""
+                << text::repr(n.strValue().data(), n.strValue().size()) << "\")";
     }
     case AstRawString: {
-      return os << '(' << ast_typename(n.type) << " `"
-                << text::repr(n.value.str.data(), n.value.str.size()) << "`)";
+      return os << '(' << ast_typename(n.type()) << " `"
+                << text::repr(n.strValue().data(), n.strValue().size()) << "`)";
     }
 
     // with UChar value, with children
     case AstUnaryOp: {
-      os << '(' << ast_typename(n.type) << ' '
-         << text::encodeUTF8((UChar)n.value.i);
+      os << '(' << ast_typename(n.type()) << ' '
+         << text::encodeUTF8((UChar)n.intValue());
       return ast_reprchild(n, os, depth+1) << ')';
     }
 
@@ -141,25 +179,108 @@ std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
   return os;
 }
 
-// Free list
 
-struct SibLink {
-  AstNode* get(AstNode& a) const { return a.nextSib; }
-  void set(AstNode& a, AstNode* b) const { a.nextSib = b; }
-};
+std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth) {
+  return repr(AstNodeView{n}, os, depth);
+}
+
+
+std::ostream& ast_repr(AstRef n, std::ostream& os, uint32_t depth) {
+  return repr(n, os, depth);
+}
 
-struct ChildLink {
-  AstNode* get(AstNode& a) const { return a.children.first; }
-  void set(AstNode& a, AstNode* b) const { a.children.first = b; }
+// Allocator
+
+struct AstAllocator::Slab {
+  Slab* prev;
+  // followed by nodes
 };
 
-static FreeList<AstNode, SibLink, ChildLink> freelist;
+AstAllocator::AstAllocator(AstAllocator&& other)
+  : _slab{other._slab}
+  , _p{other._p}
+  , _end{other._end}
+  , _freep{other._freep}
+{
+  other._slab = nullptr;
+  other._p = other._end = nullptr;
+  other._freep = nullptr;
+}
+
+
+AstAllocator::~AstAllocator() {
+  reset();
+}
+
+
+void AstAllocator::reset() {
+  while (_slab != nullptr) {
+    auto prev = _slab->prev;
+    std::free(_slab);
+    _slab = prev;
+  }
+  _p = _end = nullptr;
+  _freep = nullptr;
+}
+
 
-AstNode* AstAllocator::alloc() {
-  return freelist.alloc(_freep);
+AstNode* AstAllocator::allocSlow() {
+  AstNode* n;
+  if (_freep != nullptr) {
+    // Reuse a freed node. Nodes from fresh slabs are zeroed so do the same here.
+    n = _freep;
+    _freep = n->nextSib;
+  } else {
+    // Current slab is full
+    auto slab = (Slab*)calloc(1, SlabSize);
+    if (slab == nullptr) {
+      return nullptr;
+    }
+    slab->prev = _slab;
+    _slab = slab;
+    constexpr size_t headerSize = (sizeof(Slab) + alignof(AstNode) - 1) & ~(alignof(AstNode) - 1);
+    _p = (char*)slab + headerSize;
+    _end = (char*)slab + SlabSize;
+    n = (AstNode*)_p;
+    _p += sizeof(AstNode);
+    return n;
+  }
+  memset((void*)n, 0, sizeof(AstNode));
+  return n;
+}
+
+
+AstNode* AstAllocator::alloc(size_t count) {
+  if (size_t(_end - _p) / sizeof(AstNode) >= count) {
+    auto n = (AstNode*)_p;
+    _p += count * sizeof(AstNode);
+    return n;
+  }
+  // Give the nodes a slab of their own, behind the current one so that
+  // alloc() keeps using whatever is left of that.
+  constexpr size_t headerSize = (sizeof(Slab) + alignof(AstNode) - 1) & ~(alignof(AstNode) - 1);
+  auto slab = (Slab*)calloc(1, headerSize + count * sizeof(AstNode));
+  if (slab == nullptr) {
+    return nullptr;
+  }
+  if (_slab == nullptr) {
+    slab->prev = nullptr;
+    _slab = slab;
+  } else {
+    slab->prev = _slab->prev;
+    _slab->prev = slab;
+  }
+  return (AstNode*)((char*)slab + headerSize);
 }
 
+
 void AstAllocator::free(AstNode* n) {
-  n->ty = nullptr; // TODO free?
-  freelist.free(_freep, n);
+  // first, free any children
+  for (auto cn = n->children.first; cn != nullptr; ) {
+    auto next = cn->nextSib;
+    free(cn);
+    cn = next;
+  }
+  n->nextSib = _freep;
+  _freep = n;
 }
@@ -14,6 +14,7 @@
   _( Program ) \
   _( Bool ) \
   _( IntConst ) \
+  _( FloatConst ) \
   _( DataTail ) \
   _( String ) \
   _( RawString ) \
@@ -79,14 +80,76 @@ struct AstNode {
 std::ostream& ast_repr(AstNode& n, std::ostream& os, uint32_t depth=0);
 
 
-// Node allocator
+// Calls fn(AstNode&) with the name node of each module-level identifier
+// declared by top-level node n, until fn returns false. Returns false if
+// fn did.
+template <typename F>
+inline bool ast_forEachDeclName(AstNode& n, F fn) {
+  switch (n.type) {
+    case AstFuncDecl:
+      return fn(n);
+    case AstTypeDecl:
+      // (TypeDecl (TypeSpec name ...) ...)
+      for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
+        if (!fn(*cn)) {
+          return false;
+        }
+      }
+      return true;
+    case AstConstDecl:
+      // (ConstDecl (Ident name) (ConstSpec count Type? (Ident name)... expr...) ...)
+      for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
+        if (cn->type == AstIdent) {
+          if (!fn(*cn)) {
+            return false;
+          }
+          continue;
+        }
+        auto idn = cn->children.first;
+        uint64_t count = cn->value.i;
+        if (count > 0xffffffff) {
+          count -= 0xffffffff; // typed
+          idn = idn->nextSib;
+        }
+        for (; count != 0 && idn != nullptr; --count, idn = idn->nextSib) {
+          if (!fn(*idn)) {
+            return false;
+          }
+        }
+      }
+      return true;
+    default:
+      // Methods are named within their receiver type, not the module
+      return true;
+  }
+}
+
+
+// Node allocator.
+// Nodes are bump-allocated from slabs owned by the allocator, so an allocator
+// is meant to be used by one translation unit (and one thread) at a time.
+// All nodes are released at once when the allocator is destroyed or reset,
+// without visiting them. Note that strings referenced by nodes are not
+// released (just like with free.)
 struct AstAllocator {
-  // Allocate a node. Null is returned only when ENOMEM.
+  static constexpr size_t SlabSize = 64 * 1024;
+
+  // Allocate a zeroed node. Null is returned only when ENOMEM.
   AstNode* alloc();
 
-  // Free a node previously allocated with this allocator.
+  // Allocate `count` zeroed nodes which are adjacent in memory, e.g. for
+  // materializing a tree that was stored elsewhere. The nodes can be freed
+  // one at a time like any other. Null is returned only when ENOMEM.
+  AstNode* alloc(size_t count);
+
+  // Free a node and its children, making them available to future calls
+  // to alloc. Only needed for nodes that are discarded before the
+  // allocator is reset.
   void free(AstNode*);
 
+  // Release all nodes at once. Any nodes previously allocated become invalid.
+  void reset();
+
   // Convenience helpers to alloc & set type.
   // E.g. allocIdent() => n.type==AstNode::Ident
   // #define M(Name) \
@@ -99,8 +162,25 @@ struct AstAllocator {
   // #undef M
 
   AstAllocator() = default;
-  AstAllocator(AstAllocator&&) = default;
+  AstAllocator(AstAllocator&&);
+  ~AstAllocator();
 private:
   AstAllocator(const AstAllocator&) = delete;
-  AstNode* _freep = nullptr; // free nodes
+  struct Slab;
+  AstNode* allocSlow();
+
+  Slab*    _slab = nullptr;   // current slab; earlier slabs are linked from it
+  char*    _p = nullptr;      // next free byte in _slab
+  char*    _end = nullptr;    // end of _slab
+  AstNode* _freep = nullptr;  // freed nodes
 };
+
+
+inline AstNode* AstAllocator::alloc() {
+  if (_freep == nullptr && size_t(_end - _p) >= sizeof(AstNode)) {
+    auto n = (AstNode*)_p;
+    _p += sizeof(AstNode);
+    return n;
+  }
+  return allocSlow(); // reuse a freed node or start a new slab
+}
@@ -0,0 +1,394 @@
+#include "astcache.h"
+#include "astflat.h"
+#include "readfile.h"
+#include <map>
+#include <vector>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Entry layout. All integers are in host byte order; an entry written on a
+// machine with a different byte order simply doesn't match kMagic.
+//
+//   Header
+//   Node     nodes[nnodes]     pre-order; nodes[0] is the Program node
+//   Str      strs[nstrs]
+//   Import   imports[nimports]
+//   UChar    doc[ndoc]         package doc comment
+//   char     strdata[strsize]  string bytes, each followed by a 0 byte
+//
+// Node and string references are indices. Optional node references are
+// index+1 with 0 meaning "none".
+
+namespace {
+
+static const char     kMagic[8] = {'c','o','x','a','s','t','\0','\1'};
+static const uint32_t kVersion = 1; // of the format; the parser is covered by AstCache::build
+static const uint32_t kNoStr = 0xffffffff;
+static const uint8_t  kNoType = 0xff;
+
+struct Header {
+  char       magic[8];
+  uint32_t   version;
+  uint32_t   nastTypes;  // number of AstType values, which are stored as bytes
+  hash::B16  key;
+  uint64_t   srcSize;
+  uint32_t   nnodes;
+  uint32_t   nstrs;
+  uint32_t   nimports;
+  uint32_t   ndoc;
+  uint32_t   strsize;
+  uint32_t   pkgname;    // string index or kNoStr
+  SrcLoc     pkgloc;
+};
+
+struct Node {
+  uint8_t    type;       // AstType
+  uint8_t    ty;         // TypeTag of a simple type, or kNoType
+  uint16_t   _unused;
+  uint32_t   firstChild; // index+1
+  uint32_t   nextSib;    // index+1
+  SrcLoc     loc;
+  uint64_t   value;      // string index for ast_hasStrValue types
+};
+
+struct Str {
+  uint32_t   offset;     // into strdata
+  uint32_t   size;
+  uint32_t   hash;       // IStr::hash
+};
+
+struct Import {
+  uint32_t   path;       // string index
+  uint32_t   name;       // node index+1
+  SrcLoc     loc;
+};
+
+static constexpr uint32_t kNumAstTypes = 0
+  #define M(Name) + 1
+  RX_AST_NODES(M)
+  #undef M
+  ;
+
+// Types which can be stored, indexed by TypeTag
+static const Type* const kSimpleTypes[] = {
+  &TypeUnresolved, &TypeBool, &TypeI8, &TypeU8, &TypeI16, &TypeU16, &TypeI32,
+  &TypeU32, &TypeI64, &TypeU64, &TypeF32, &TypeF64, &TypeUint, &TypeInt,
+  &TypeFloat,
+};
+static const size_t kNumSimpleTypes = sizeof(kSimpleTypes) / sizeof(*kSimpleTypes);
+
+
+// Builds the arrays of an entry
+struct writer {
+  std::vector<Node>   nodes;
+  std::vector<Str>    strs;
+  std::string         strdata;
+  std::map<IStr,uint32_t,IStr::Less> strIndex; // holds on to strings
+  Err                 err;
+
+  uint32_t addStr(const IStr& s) {
+    auto it = strIndex.find(s);
+    if (it != strIndex.end()) {
+      return it->second;
+    }
+    uint32_t i = (uint32_t)strs.size();
+    strs.push_back({(uint32_t)strdata.size(), s.size(), s.hash()});
+    strdata.append(s.data(), s.size());
+    strdata += '\0';
+    strIndex.emplace(s, i);
+    return i;
+  }
+
+  // Adds n and its children in pre-order. Returns index of n.
+  uint32_t addTree(const AstNode& n) {
+    uint32_t i = (uint32_t)nodes.size();
+    nodes.emplace_back();
+    {
+      Node& r = nodes.back();
+      r.type = (uint8_t)n.type;
+      r.ty = kNoType;
+      r.loc = n.loc;
+      r.value = ast_hasStrValue(n.type) ? addStr(n.value.str) : n.value.i;
+      if (n.ty != nullptr) {
+        for (size_t t = 0; t != kNumSimpleTypes; ++t) {
+          if (kSimpleTypes[t] == n.ty) {
+            r.ty = (uint8_t)t;
+          }
+        }
+        if (r.ty == kNoType) {
+          err = Err("AST refers to a type which can not be cached");
+        }
+      }
+      if (n.typeDef != nullptr) {
+        err = Err("AST refers to a type definition which can not be cached");
+      }
+    }
+    uint32_t prev = 0;
+    for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
+      uint32_t ci = addTree(*cn) + 1;
+      if (prev == 0) {
+        nodes[i].firstChild = ci;
+      } else {
+        nodes[prev - 1].nextSib = ci;
+      }
+      prev = ci;
+    }
+    return i;
+  }
+};
+
+
+// True if loc is within a source of srcSize bytes. Locations are used to
+// index the source when errors are reported.
+static bool validLoc(const SrcLoc& loc, uint64_t srcSize) {
+  return uint64_t(loc.offset) + loc.length <= srcSize;
+}
+
+
+template <typename T>
+static bool writeArray(FILE* f, const T* p, size_t count) {
+  return count == 0 || fwrite((const void*)p, sizeof(T), count, f) == count;
+}
+
+
+// Checks that the node records of an entry only refer to things within it,
+// and that they form trees: the program, and the names of imports
+static bool validNodes(const Header& h, const Node* nodes, const Import* imports) {
+  // Whether each node is the first child or next sibling of another node, or
+  // the name of an import. Every node but the program must be exactly one of
+  // those, exactly once, or nodes would be shared and freed twice.
+  std::vector<bool> linked(h.nnodes);
+  auto link = [&](uint32_t ref) {
+    if (ref == 0) {
+      return true;
+    }
+    if (linked[ref - 1]) {
+      return false;
+    }
+    linked[ref - 1] = true;
+    return true;
+  };
+  for (uint32_t i = 0; i != h.nnodes; ++i) {
+    auto& r = nodes[i];
+    if (r.type == AstNone || r.type > kNumAstTypes ||
+        (r.ty != kNoType && r.ty >= kNumSimpleTypes) ||
+        r.firstChild > h.nnodes || r.nextSib > h.nnodes ||
+        // Pre-order means references only go forward, which rules out cycles
+        (r.firstChild != 0 && r.firstChild != i + 2) ||
+        (r.nextSib != 0 && r.nextSib <= i + 1) ||
+        !link(r.firstChild) || !link(r.nextSib) || !validLoc(r.loc, h.srcSize) ||
+        (ast_hasStrValue((AstType)r.type) && r.value >= h.nstrs))
+    {
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i != h.nimports; ++i) {
+    if (!link(imports[i].name)) {
+      return false;
+    }
+  }
+  for (uint32_t i = 1; i < h.nnodes; ++i) {
+    if (!linked[i]) {
+      return false;
+    }
+  }
+  return h.nnodes != 0 && !linked[0] && nodes[0].type == AstProgram &&
+         nodes[0].nextSib == 0;
+}
+
+} // namespace
+
+
+AstCache::Key AstCache::key(const char* src, size_t len) const {
+  return key(hash::wyhash128(src, len));
+}
+
+
+AstCache::Key AstCache::key(const hash::B16& srchash) const {
+  hash::B16 in[2] = {build, srchash};
+  return hash::wyhash128((const char*)in, sizeof(in));
+}
+
+
+std::string AstCache::filename(const Key& key) const {
+  return dir + "/" + hash::encode_128(key) + ".ast";
+}
+
+
+bool AstCache::load(const Key& key, size_t srcSize, IStr::SharedSet& strings,
+                    AstAllocator& astalloc, AstPkgDecl& pkgdecl, Imports& imps,
+                    AstNode*& prog) const
+{
+  FILE* f = fopen(filename(key).c_str(), "r");
+  if (f == nullptr) {
+    return false;
+  }
+  size_t size = 0;
+  const char* p = mapfile(f, size, 0xffffffff);
+  fclose(f);
+  if (p == nullptr) {
+    return false;
+  }
+
+  // Locate and check the arrays before touching anything
+  auto& h = *(const Header*)p;
+  size_t nodesOffs = sizeof(Header);
+  size_t strsOffs = nodesOffs + sizeof(Node) * size_t(size >= sizeof(Header) ? h.nnodes : 0);
+  bool ok = size >= sizeof(Header) &&
+            memcmp(h.magic, kMagic, sizeof(kMagic)) == 0 &&
+            h.version == kVersion &&
+            h.nastTypes == kNumAstTypes &&
+            memcmp(h.key.bytes, key.bytes, sizeof(key.bytes)) == 0 &&
+            h.srcSize == srcSize;
+  size_t importsOffs = strsOffs + sizeof(Str) * size_t(ok ? h.nstrs : 0);
+  size_t docOffs = importsOffs + sizeof(Import) * size_t(ok ? h.nimports : 0);
+  size_t strdataOffs = docOffs + sizeof(UChar) * size_t(ok ? h.ndoc : 0);
+  ok = ok && strdataOffs + h.strsize == size &&
+       (h.pkgname == kNoStr || h.pkgname < h.nstrs) &&
+       validLoc(h.pkgloc, h.srcSize);
+  auto nodes = (const Node*)(p + nodesOffs);
+  auto strs = (const Str*)(p + strsOffs);
+  auto imports = (const Import*)(p + importsOffs);
+  auto doc = (const UChar*)(p + docOffs);
+  auto strdata = p + strdataOffs;
+  for (uint32_t i = 0; ok && i != h.nstrs; ++i) {
+    ok = strs[i].offset < h.strsize && h.strsize - strs[i].offset > strs[i].size;
+  }
+  for (uint32_t i = 0; ok && i != h.nimports; ++i) {
+    ok = imports[i].path < h.nstrs && imports[i].name <= h.nnodes &&
+         validLoc(imports[i].loc, h.srcSize);
+  }
+  ok = ok && validNodes(h, nodes, imports);
+  if (!ok) {
+    unmapfile(p, size);
+    return false;
+  }
+
+  // Intern each distinct string once
+  std::vector<IStr> istrs;
+  istrs.reserve(h.nstrs);
+  for (uint32_t i = 0; i != h.nstrs; ++i) {
+    istrs.push_back(strings.get(strdata + strs[i].offset, strs[i].size, strs[i].hash));
+  }
+
+  // Turn node records into nodes, with indices replaced by pointers
+  AstNode* base = astalloc.alloc(h.nnodes);
+  if (base == nullptr) {
+    unmapfile(p, size);
+    return false;
+  }
+  // Back to front, since children and siblings come after a node and have
+  // to be linked up before its last child can be found
+  for (uint32_t i = h.nnodes; i-- != 0; ) {
+    auto& r = nodes[i];
+    auto& n = base[i];
+    n.type = (AstType)r.type;
+    n.loc = r.loc;
+    if (ast_hasStrValue(n.type)) {
+      n.value.str = istrs[r.value];
+    } else {
+      n.value.i = r.value;
+    }
+    n.ty = r.ty == kNoType ? nullptr : kSimpleTypes[r.ty];
+    n.nextSib = r.nextSib == 0 ? nullptr : &base[r.nextSib - 1];
+    if (r.firstChild != 0) {
+      n.children.first = &base[r.firstChild - 1];
+      auto last = n.children.first;
+      while (last->nextSib != nullptr) {
+        last = last->nextSib;
+      }
+      n.children.last = last;
+    }
+  }
+  prog = &base[0];
+
+  pkgdecl.name = h.pkgname == kNoStr ? IStr{} : istrs[h.pkgname];
+  pkgdecl.doc.assign(doc, h.ndoc);
+  pkgdecl.srcloc = h.pkgloc;
+  for (uint32_t i = 0; i != h.nimports; ++i) {
+    auto& r = imports[i];
+    ImportSpec spec;
+    spec.name = r.name == 0 ? nullptr : &base[r.name - 1];
+    spec.loc = r.loc;
+    auto& path = istrs[r.path];
+    imps[std::string(path.data(), path.size())].insert(spec);
+  }
+
+  unmapfile(p, size);
+  return true;
+}
+
+
+Err AstCache::store(const Key& key, size_t srcSize, const AstPkgDecl& pkgdecl,
+                    const Imports& imps, const AstNode& prog) const
+{
+  writer w;
+  w.addTree(prog);
+
+  std::vector<Import> imports;
+  for (auto& e : imps) {
+    for (auto& spec : e.second) {
+      Import r;
+      r.path = w.addStr(IStr{e.first});
+      r.name = spec.name == nullptr ? 0 : w.addTree(*spec.name) + 1;
+      r.loc = spec.loc;
+      imports.push_back(r);
+    }
+  }
+  if (w.err) {
+    return std::move(w.err);
+  }
+
+  Header h;
+  memset((void*)&h, 0, sizeof(h));
+  memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.version = kVersion;
+  h.nastTypes = kNumAstTypes;
+  h.key = key;
+  h.srcSize = srcSize;
+  h.pkgname = pkgdecl.name == nullptr ? kNoStr : w.addStr(pkgdecl.name);
+  h.pkgloc = pkgdecl.srcloc;
+  h.nnodes = (uint32_t)w.nodes.size();
+  h.nstrs = (uint32_t)w.strs.size();
+  h.nimports = (uint32_t)imports.size();
+  h.ndoc = (uint32_t)pkgdecl.doc.size();
+  h.strsize = (uint32_t)w.strdata.size();
+
+  // Write to a temporary file and move it in place, so that readers never
+  // see a partial entry
+  auto path = filename(key);
+  std::string tmppath = path + ".XXXXXX";
+  int fd = mkstemp(&tmppath[0]);
+  if (fd == -1) {
+    return Err(tmppath + ": " + strerror(errno));
+  }
+  FILE* f = fchmod(fd, 0644) == 0 ? fdopen(fd, "w") : nullptr;
+  if (f == nullptr) {
+    int e = errno;
+    close(fd);
+    unlink(tmppath.c_str());
+    return Err(tmppath + ": " + strerror(e));
+  }
+  bool ok = writeArray(f, &h, 1) &&
+            writeArray(f, w.nodes.data(), w.nodes.size()) &&
+            writeArray(f, w.strs.data(), w.strs.size()) &&
+            writeArray(f, imports.data(), imports.size()) &&
+            writeArray(f, pkgdecl.doc.data(), pkgdecl.doc.size()) &&
+            writeArray(f, w.strdata.data(), w.strdata.size());
+  int e = errno;
+  if (fclose(f) != 0 && ok) {
+    ok = false;
+    e = errno;
+  }
+  if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) {
+    if (ok) {
+      e = errno;
+    }
+    unlink(tmppath.c_str());
+    return Err(path + ": " + strerror(e));
+  }
+  return Err::OK();
+}
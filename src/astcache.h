@@ -0,0 +1,58 @@
+#pragma once
+#include "ast.h"
+#include "error.h"
+#include "hash.h"
+#include "imp.h"
+#include <string>
+
+// On-disk cache of parsed translation units.
+//
+// A unit is stored in a file named after a 128-bit hash of its source and of
+// the compiler (see build::compilerId), so that any change to the source or
+// to cox makes for a different file and entries never need to be
+// invalidated. An entry holds the package clause, the imports and
+// all AST nodes in a flat, versioned binary format. Nodes refer to each other
+// and to strings by index.
+//
+// Loading maps the file, interns each distinct string once, and then turns
+// the node records into AstNodes in one block of memory, replacing indices
+// with pointers as it goes. No lexing or parsing happens, and nodes are not
+// allocated one by one.
+//
+// Entries are written to a temporary file which is then renamed, so several
+// processes can share a cache directory.
+//
+//   AstCache cache{"/tmp/coxcache", build::compilerId()};
+//   auto key = cache.key(src, srclen);
+//   if (!cache.load(key, srclen, strings, astalloc, pkgdecl, imps, prog)) {
+//     ... parse ...
+//     cache.store(key, srclen, pkgdecl, imps, *prog);
+//   }
+//
+struct AstCache {
+  using Key = hash::B16;
+
+  std::string dir;      // where entries are stored; must exist
+  hash::B16   build{};  // identity of the compiler which parses
+
+  // Key for source of len bytes at src
+  Key key(const char* src, size_t len) const;
+  // Key for a source with the wyhash128 srchash, for when that is known
+  Key key(const hash::B16& srchash) const;
+
+  // Path of the entry for key, i.e. dir/KEY.ast
+  std::string filename(const Key&) const;
+
+  // Loads the entry for key into pkgdecl, imps and prog. Nodes are allocated
+  // from astalloc and prog is set to the Program node. Returns false if there
+  // is no valid entry for key (e.g. it was written by another version), in
+  // which case nothing is allocated.
+  bool load(const Key&, size_t srcSize, IStr::SharedSet&, AstAllocator&,
+            AstPkgDecl& pkgdecl, Imports& imps, AstNode*& prog) const;
+
+  // Stores a successfully parsed unit as the entry for key. Returns an error
+  // if the entry could not be written or if the AST refers to types which
+  // can not be stored (only the predeclared simple types can.)
+  Err store(const Key&, size_t srcSize, const AstPkgDecl&, const Imports&,
+            const AstNode& prog) const;
+};
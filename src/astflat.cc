@@ -0,0 +1,120 @@
+#include "astflat.h"
+
+bool ast_hasStrValue(AstType t) {
+  switch (t) {
+    case AstFuncDecl:
+    case AstMethodDecl:
+    case AstQualIdent:
+    case AstTypeSpec:
+    case AstIdent:
+    case AstString:
+    case AstRawString:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+AstFlat::AstFlat() {
+  reset();
+}
+
+
+AstFlat::AstFlat(AstFlat&& other) : AstFlat() {
+  *this = std::move(other);
+}
+
+
+AstFlat& AstFlat::operator=(AstFlat&& other) {
+  if (this != &other) {
+    releaseStrs();
+    _hot = std::move(other._hot);
+    _locs = std::move(other._locs);
+    _values = std::move(other._values);
+    _types = std::move(other._types);
+    // leave other empty but valid, i.e. with just the None node
+    other.reset();
+  }
+  return *this;
+}
+
+
+AstFlat::~AstFlat() {
+  releaseStrs();
+}
+
+
+void AstFlat::reset() {
+  _hot.clear();
+  _locs.clear();
+  _values.clear();
+  _types.clear();
+  // index 0 is the "None" node
+  _hot.push_back({AstNone, None, None});
+  _locs.emplace_back();
+  _values.push_back({nullptr});
+  _types.push_back(nullptr);
+}
+
+
+void AstFlat::releaseStrs() {
+  for (Index i = 1; i < (Index)_hot.size(); ++i) {
+    if (ast_hasStrValue((AstType)_hot[i].type)) {
+      IStr::__release(_values[i].str);
+    }
+  }
+}
+
+
+AstFlat::Index AstFlat::add(AstType t, const SrcLoc& loc) {
+  Index i = (Index)_hot.size();
+  _hot.push_back({(uint8_t)t, None, None});
+  _locs.push_back(loc);
+  _values.push_back({nullptr});
+  _types.push_back(nullptr);
+  return i;
+}
+
+
+void AstFlat::appendChild(Index parent, Index& lastChild, Index child) {
+  if (lastChild == None) {
+    _hot[parent].firstChild = child;
+  } else {
+    _hot[lastChild].nextSib = child;
+  }
+  lastChild = child;
+}
+
+
+void AstFlat::setStr(Index i, const IStr& s) {
+  assert(ast_hasStrValue((AstType)_hot[i].type));
+  IStr::__retain(s.self);
+  IStr::__release(_values[i].str);
+  _values[i].str = s.self;
+}
+
+
+AstFlat AstFlat::fromTree(const AstNode& root) {
+  AstFlat f;
+  f.addTree(root);
+  return f;
+}
+
+
+AstFlat::Index AstFlat::addTree(const AstNode& n) {
+  Index i = add(n.type, n.loc);
+  if (ast_hasStrValue(n.type)) {
+    setStr(i, n.value.str);
+  } else {
+    _values[i].i = n.value.i; // also copies f
+  }
+  _types[i] = n.ty;
+
+  Index last = None;
+  for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
+    Index ci = addTree(*cn);
+    appendChild(i, last, ci);
+  }
+  return i;
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include "ast.h"
+#include <vector>
+
+struct AstRef;
+
+// AstFlat is a compact, read-mostly representation of an AST.
+//
+// Nodes live in contiguous arrays and refer to each other by 32-bit index
+// rather than by pointer. The fields needed to walk a tree (type, first child
+// and next sibling) are stored together, apart from the fields that are only
+// needed once a node has been found (source location, value and type), so
+// that traversals touch as little memory as possible.
+//
+// Nodes are stored in pre-order, so a subtree occupies a contiguous range of
+// indices and a depth-first walk reads memory front to back.
+//
+// Index 0 is never a node, which lets 0 (AstFlat::None) mean "no node".
+// String values are retained by the AstFlat.
+//
+//   AstFlat flat = AstFlat::fromTree(*prog);
+//   for (auto decl : flat.root().children()) {
+//     if (decl.type() == AstFuncDecl) { ... }
+//   }
+//
+struct AstFlat {
+  using Index = uint32_t;
+  static constexpr Index None = 0;
+
+  AstFlat();
+  AstFlat(AstFlat&&); // leaves the source empty
+  AstFlat& operator=(AstFlat&&);
+  ~AstFlat();
+
+  // Builds a flat copy of the tree rooted at `root`
+  static AstFlat fromTree(const AstNode& root);
+
+  // Adds a node and returns its index. Nodes should be added in pre-order,
+  // i.e. a node before its children, for locality.
+  Index add(AstType, const SrcLoc&);
+  // Links `child` as the next child of `parent`. `lastChild` is the previous
+  // child that was appended to `parent` (or None) and is updated to `child`.
+  void appendChild(Index parent, Index& lastChild, Index child);
+
+  // Root node, i.e. the first node added
+  AstRef root() const;
+  AstRef at(Index) const;
+  uint32_t size() const { return (uint32_t)_hot.size() - 1; } // number of nodes
+
+  // Hot: read by every traversal
+  struct Hot {
+    uint8_t type;       // AstType
+    Index   firstChild;
+    Index   nextSib;
+  };
+
+  // Value of a node; which field is valid depends on the node type
+  // (see ast_hasStrValue.)
+  union Value {
+    IStr::Imp* str;
+    uint64_t   i;
+    double     f;
+  };
+
+  const Hot&    hot(Index i) const { return _hot[i]; }
+  const SrcLoc& loc(Index i) const { return _locs[i]; }
+  const Value&  value(Index i) const { return _values[i]; }
+  const Type*   ty(Index i) const { return _types[i]; }
+
+  void setInt(Index i, uint64_t v) { _values[i].i = v; }
+  void setFloat(Index i, double v) { _values[i].f = v; }
+  void setStr(Index i, const IStr&);
+  void setTy(Index i, const Type* t) { _types[i] = t; }
+
+private:
+  AstFlat(const AstFlat&) = delete;
+  Index addTree(const AstNode&);
+  void reset();       // drops all nodes but None, without releasing strings
+  void releaseStrs(); // releases the string values of all nodes
+
+  std::vector<Hot>         _hot;
+  std::vector<SrcLoc>      _locs;
+  std::vector<Value>       _values;
+  std::vector<const Type*> _types;
+};
+
+
+// True for node types which have a string value
+bool ast_hasStrValue(AstType);
+
+
+// A reference to a node of an AstFlat. Small enough to pass by value.
+struct AstRef {
+  const AstFlat*  flat = nullptr;
+  AstFlat::Index  index = AstFlat::None;
+
+  explicit operator bool() const { return index != AstFlat::None; }
+
+  AstType       type() const { return (AstType)flat->hot(index).type; }
+  const SrcLoc& loc() const { return flat->loc(index); }
+  uint64_t      intValue() const { return flat->value(index).i; }
+  double        floatValue() const { return flat->value(index).f; }
+  IStr          strValue() const { return IStr{flat->value(index).str}; }
+  const Type*   ty() const { return flat->ty(index); }
+
+  AstRef firstChild() const { return {flat, flat->hot(index).firstChild}; }
+  AstRef nextSib() const { return {flat, flat->hot(index).nextSib}; }
+
+  struct Children;
+  Children children() const;
+};
+
+
+struct AstRef::Children {
+  struct Iter {
+    AstRef n;
+    AstRef operator*() const { return n; }
+    Iter& operator++() { n = n.nextSib(); return *this; }
+    bool operator!=(const Iter& other) const { return n.index != other.n.index; }
+    bool operator==(const Iter& other) const { return n.index == other.n.index; }
+  };
+  AstRef first;
+  Iter begin() const { return {first}; }
+  Iter end() const { return {{first.flat, AstFlat::None}}; }
+  bool empty() const { return !first; }
+};
+
+
+inline AstRef::Children AstRef::children() const { return {firstChild()}; }
+
+
+inline AstRef AstFlat::root() const { return {this, size() != 0 ? 1u : None}; }
+inline AstRef AstFlat::at(Index i) const { return {this, i}; }
+
+
+// Appends readable representation of node `n` to `os`, in the same format
+// as ast_repr(AstNode&). Returns `os`.
+std::ostream& ast_repr(AstRef n, std::ostream& os, uint32_t depth=0);
@@ -0,0 +1,722 @@
+#include "build.h"
+#include "readfile.h"
+#include "text.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+  #include <mach-o/dyld.h>
+#endif
+
+namespace build {
+
+// Largest source file we accept
+static const size_t kMaxSrcSize = 102400000;
+
+// Part of every OutputCache key, together with the compiler's identity.
+// Change when what goes into keys changes.
+static const char kOutputCacheVersion[] = "cox wasm 2";
+
+
+Err SrcFile::load(const char* filename) {
+  // Regular files are mapped into memory and lexed in place; pipes and stdin
+  // are read into a buffer.
+  name = filename == nullptr ? "<stdin>" : filename;
+  FILE* f = stdin;
+  if (filename != nullptr && !(f = fopen(filename, "r"))) {
+    return Err(name + ": " + strerror(errno));
+  }
+  if (f != stdin) {
+    p = mapfile(f, size, kMaxSrcSize);
+    if (p != nullptr) {
+      mapped = true;
+    } else if (errno != ENODEV) {
+      int e = errno;
+      fclose(f);
+      return Err(name + ": " + strerror(e));
+    }
+  }
+  if (p == nullptr && !(p = readfile(f, size, kMaxSrcSize))) {
+    int e = errno;
+    if (f != stdin) {
+      fclose(f);
+    }
+    return Err(name + ": " + strerror(e));
+  }
+  if (f != stdin) {
+    fclose(f);
+  }
+  return Err::OK();
+}
+
+
+SrcFile::~SrcFile() {
+  if (mapped) {
+    unmapfile(p, size);
+  } else {
+    free((void*)p);
+  }
+}
+
+
+static void hashSrc(Unit& u) {
+  if (!u.hashed) {
+    u.srchash = hash::wyhash128(u.src.p, u.src.size);
+    u.hashed = true;
+  }
+}
+
+
+// Parses a loaded unit
+static void parseSrc(Unit& u, IStr::SharedSet& strings, const AstCache* cache) {
+  // Source which has been parsed before is valid and need not be checked
+  AstCache::Key key;
+  if (cache != nullptr) {
+    hashSrc(u);
+    key = cache->key(u.srchash);
+    if (cache->load(key, u.src.size, strings, u.astalloc, u.pkgdecl, u.imps, u.prog)) {
+      u.cached = true;
+      return;
+    }
+  }
+
+  // Validate encoding upfront so that the lexer can decode without checks
+  size_t badOffset = text::findInvalidUTF8(u.src.p, u.src.size);
+  if (badOffset != u.src.size) {
+    u.errloc.offset = (uint32_t)badOffset;
+    u.errloc.length = 1;
+    u.err = Err(ParseErrEncoding, "invalid UTF-8 data");
+    return;
+  }
+
+  Parser p(u.src.p, u.src.size, strings, u.mod);
+  u.prog = u.astalloc.alloc();
+  u.prog->type = AstProgram;
+  if (!(u.err = p.parsePkgDecl(u.pkgdecl)) &&
+      !(u.err = p.parseImports(u.astalloc, u.imps))) {
+    u.err = p.parseProgram(u.astalloc, *u.prog);
+  }
+  if (u.err) {
+    u.errloc = p.srcLoc();
+  } else if (cache != nullptr) {
+    // Failing to store only makes the next build slower
+    cache->store(key, u.src.size, u.pkgdecl, u.imps, *u.prog);
+  }
+}
+
+
+void parseUnit(Unit& u, const char* filename, IStr::SharedSet& strings,
+               const AstCache* cache) {
+  u.err = u.src.load(filename);
+  if (!u.err) {
+    parseSrc(u, strings, cache);
+  }
+}
+
+
+void scanUnit(Unit& u, const char* filename, bool withHash) {
+  u.err = u.src.load(filename);
+  if (!u.err) {
+    u.err = depscan(u.src.p, u.src.size, u.header);
+    u.errloc = u.header.errloc;
+  }
+  if (!u.err && withHash) {
+    hashSrc(u);
+  }
+}
+
+
+void parseScannedUnit(Unit& u, IStr::SharedSet& strings, const AstCache* cache) {
+  assert(!u.err);
+  parseSrc(u, strings, cache);
+}
+
+
+Err mergeUnit(Module& mod, AstNode& prog, Unit& u) {
+  if (u.pkgdecl.name != nullptr) {
+    if (mod.name == nullptr) {
+      mod.name = u.pkgdecl.name;
+    } else if (mod.name != u.pkgdecl.name) {
+      return Err(ParseErr, "package ", u.pkgdecl.name, " differs from package ",
+                 mod.name);
+    }
+  }
+
+  Err err;
+  AstNode* next;
+  for (auto n = u.prog->children.first; n != nullptr; n = next) {
+    next = n->nextSib; // appendChild clears nextSib
+    ast_forEachDeclName(*n, [&](AstNode& name) {
+      if (mod.addNamed(name.value.str, name) != nullptr) {
+        u.errloc = name.loc;
+        err = Err(ParseErrSyntax, name.value.str, " redeclared in this package");
+        return false;
+      }
+      return true;
+    });
+    if (err) {
+      u.prog->children.first = n; // keep the rest with the unit
+      return err;
+    }
+    prog.appendChild(*n);
+  }
+  u.prog->children = {};
+  return Err::OK();
+}
+
+
+void parallelFor(size_t n, unsigned jobs, const std::function<void(size_t)>& fn) {
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (jobs > n) {
+    jobs = (unsigned)n;
+  }
+
+  // Work is handed out one index at a time, so that a few large files don't
+  // hold up the rest
+  std::atomic<size_t> nexti{0};
+  auto work = [&] {
+    for (size_t i; (i = nexti.fetch_add(1, std::memory_order_relaxed)) < n; ) {
+      fn(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(jobs > 0 ? jobs - 1 : 0);
+  for (unsigned t = 1; t < jobs; ++t) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+
+const hash::B16& compilerId() {
+  static const hash::B16 id = [] {
+    std::string path;
+    #if defined(__APPLE__)
+      uint32_t size = 0;
+      _NSGetExecutablePath(nullptr, &size);
+      path.resize(size);
+      if (_NSGetExecutablePath(&path[0], &size) != 0) {
+        path.clear();
+      }
+      path.resize(strlen(path.c_str()));
+    #elif defined(__linux__)
+      path = "/proc/self/exe";
+    #endif
+    FILE* f = path.empty() ? nullptr : fopen(path.c_str(), "r");
+    if (f != nullptr) {
+      size_t size;
+      const char* p = mapfile(f, size, SIZE_MAX);
+      fclose(f);
+      if (p != nullptr) {
+        auto h = hash::wyhash128(p, size);
+        unmapfile(p, size);
+        return h;
+      }
+    }
+    // The executable can't be read, so go by when this file was compiled
+    static const char fallback[] = __DATE__ " " __TIME__;
+    return hash::wyhash128(fallback, sizeof(fallback) - 1);
+  }();
+  return id;
+}
+
+
+// -----------------------------------------------------------------------------------------------
+// Packages
+
+static uint64_t nanotime() {
+  using namespace std::chrono;
+  return (uint64_t)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+static Err listPackage(Package& pkg) {
+  pkg.path = pkg.dir;
+  while (pkg.path.size() > 1 && pkg.path.back() == '/') {
+    pkg.path.pop_back();
+  }
+  while (pkg.path.compare(0, 2, "./") == 0) {
+    pkg.path.erase(0, 2);
+  }
+
+  DIR* d = opendir(pkg.dir.c_str());
+  if (d == nullptr) {
+    return Err(pkg.dir + ": " + strerror(errno));
+  }
+  while (auto ent = readdir(d)) {
+    size_t len = strlen(ent->d_name);
+    if (len > 3 && ent->d_name[0] != '.' && strcmp(ent->d_name + len - 3, ".co") == 0) {
+      pkg.filenames.push_back(pkg.path + '/' + ent->d_name);
+    }
+  }
+  closedir(d);
+  if (pkg.filenames.empty()) {
+    return Err(pkg.dir + ": no source files");
+  }
+  std::sort(pkg.filenames.begin(), pkg.filenames.end());
+  pkg.units.reset(new Unit[pkg.filenames.size()]);
+  return Err::OK();
+}
+
+
+// Finds the package with import path `path`, which is either its path or a
+// trailing part of it, e.g. "foo/bar" matches "src/foo/bar".
+static Package* findPackage(Packages& pkgs, const std::string& path) {
+  for (auto& pkg : pkgs) {
+    auto& p = pkg->path;
+    if (p == path ||
+        (p.size() > path.size() && p[p.size() - path.size() - 1] == '/' &&
+         p.compare(p.size() - path.size(), path.size(), path) == 0))
+    {
+      return pkg.get();
+    }
+  }
+  return nullptr;
+}
+
+
+std::string OutputCache::filename(const hash::B16& key) const {
+  return dir + "/" + hash::encode_128(key) + ".wasm";
+}
+
+
+bool OutputCache::has(const hash::B16& key) const {
+  return access(filename(key).c_str(), R_OK) == 0;
+}
+
+
+Err OutputCache::store(const hash::B16& key, const wasm::Buf& buf) const {
+  // Write to a temporary file and move it in place, so that readers never
+  // see a partial entry
+  auto path = filename(key);
+  std::string tmppath = path + ".XXXXXX";
+  int fd = mkstemp(&tmppath[0]);
+  if (fd == -1) {
+    return Err(tmppath + ": " + strerror(errno));
+  }
+  bool ok = fchmod(fd, 0644) == 0;
+  for (size_t w = 0; ok && w < buf.size(); ) {
+    ssize_t n = write(fd, (const char*)buf.startp + w, buf.size() - w);
+    ok = n > 0;
+    w += ok ? size_t(n) : 0;
+  }
+  int e = errno;
+  if (close(fd) != 0 && ok) {
+    ok = false;
+    e = errno;
+  }
+  if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) {
+    if (ok) {
+      e = errno;
+    }
+    unlink(tmppath.c_str());
+    return Err(path + ": " + strerror(e));
+  }
+  return Err::OK();
+}
+
+
+hash::B16 OutputCache::key(const Unit* units, size_t n, const hash::B16* depkeys,
+                           size_t ndeps) const {
+  std::string in = kOutputCacheVersion;
+  in += '\0';
+  in.append((const char*)build.bytes, sizeof(build.bytes));
+  // Units are merged in order, so their order matters too
+  for (size_t i = 0; i != n; ++i) {
+    auto& u = units[i];
+    auto h = u.hashed ? u.srchash : hash::wyhash128(u.src.p, u.src.size);
+    in.append((const char*)h.bytes, sizeof(h.bytes));
+  }
+  in.append((const char*)depkeys, ndeps * sizeof(hash::B16));
+  return hash::wyhash128(in.data(), in.size());
+}
+
+
+// Hash of everything that goes into the code of pkg. Keys of its
+// dependencies must have been computed.
+static hash::B16 packageKey(const Package& pkg, const OutputCache& outcache) {
+  std::vector<hash::B16> depkeys;
+  for (auto dep : pkg.deps) {
+    depkeys.push_back(dep->key);
+  }
+  return outcache.key(pkg.units.get(), pkg.filenames.size(), depkeys.data(), depkeys.size());
+}
+
+
+// Returns true if the code of a scanned package is in the output cache, in
+// which case the package need not be built
+static bool findCachedPackage(Package& pkg, IStr::SharedSet& strings,
+                              const OutputCache* outcache) {
+  if (outcache == nullptr || !outcache->has(pkg.key)) {
+    return false;
+  }
+  pkg.cached = true;
+  for (size_t i = 0; i != pkg.filenames.size() && pkg.mod.name == nullptr; ++i) {
+    if (!pkg.units[i].header.pkgname.empty()) {
+      pkg.mod.name = strings.get(pkg.units[i].header.pkgname);
+    }
+  }
+  return true;
+}
+
+
+// Returns true if a scanned package is in the package store, in which case
+// the package need not be built
+static bool findStoredPackage(Package& pkg, const PackageStore* store) {
+  if (store == nullptr) {
+    return false;
+  }
+  pkg.warm = store->find(pkg.key);
+  if (!pkg.warm) {
+    return false;
+  }
+  pkg.mod.name = pkg.warm->mod.name;
+  return true;
+}
+
+
+std::shared_ptr<const Package> PackageStore::find(const hash::B16& key) const {
+  std::lock_guard<std::mutex> lock(_mu);
+  auto it = _pkgs.find(std::string((const char*)key.bytes, sizeof(key.bytes)));
+  return it != _pkgs.end() ? it->second : nullptr;
+}
+
+
+void PackageStore::keep(Packages& pkgs) {
+  std::lock_guard<std::mutex> lock(_mu);
+  for (auto& pkg : pkgs) {
+    // Only packages built by this build have a module and AST
+    if (!pkg || pkg->warm || pkg->cached || pkg->skipped || pkg->err ||
+        pkg->prog == nullptr)
+    {
+      continue;
+    }
+    std::string key((const char*)pkg->key.bytes, sizeof(pkg->key.bytes));
+    if (_pkgs.count(key) != 0) {
+      continue; // built by another build at the same time
+    }
+    while (!_order.empty() && _pkgs.size() >= maxPackages) {
+      _pkgs.erase(_order.front());
+      _order.pop_front();
+    }
+    if (maxPackages == 0) {
+      break;
+    }
+    // The packages these point to are not kept
+    pkg->deps.clear();
+    pkg->dependents.clear();
+    pkg->critPrev = nullptr;
+    _pkgs[key] = std::move(pkg);
+    _order.push_back(key);
+  }
+}
+
+
+// Merges the parsed units of a package, in order, and generates code
+static void finishPackage(Package& pkg, const OutputCache* outcache) {
+  pkg.prog = pkg.astalloc.alloc();
+  pkg.prog->type = AstProgram;
+  for (size_t i = 0; i != pkg.filenames.size(); ++i) {
+    auto& u = pkg.units[i];
+    if (!u.err) {
+      u.err = mergeUnit(pkg.mod, *pkg.prog, u);
+    }
+    if (u.err) {
+      pkg.err = u.err;
+      pkg.errunit = &u;
+      return;
+    }
+  }
+  pkg.err = wasm::emit_module(pkg.wasm, *pkg.prog);
+  if (!pkg.err && outcache != nullptr) {
+    // Failing to store only makes the next build slower
+    outcache->store(pkg.key, pkg.wasm);
+  }
+}
+
+
+// Sorts pkgs so that every package comes after its dependencies.
+// Returns an error naming the packages of a cycle, if there is one.
+static Err topoSort(Packages& pkgs, std::vector<Package*>& order) {
+  std::vector<size_t> ndeps(pkgs.size());
+  std::map<Package*,size_t> index;
+  for (size_t i = 0; i != pkgs.size(); ++i) {
+    index[pkgs[i].get()] = i;
+    ndeps[i] = pkgs[i]->deps.size();
+    if (ndeps[i] == 0) {
+      order.push_back(pkgs[i].get());
+    }
+  }
+  for (size_t i = 0; i != order.size(); ++i) {
+    for (auto dp : order[i]->dependents) {
+      if (--ndeps[index[dp]] == 0) {
+        order.push_back(dp);
+      }
+    }
+  }
+  if (order.size() == pkgs.size()) {
+    return Err::OK();
+  }
+
+  // Every package left has a dependency that is left. Follow those from any
+  // of them until we come back around.
+  Package* pkg = nullptr;
+  for (size_t i = 0; pkg == nullptr; ++i) {
+    if (ndeps[i] != 0) {
+      pkg = pkgs[i].get();
+    }
+  }
+  std::vector<Package*> path;
+  while (std::find(path.begin(), path.end(), pkg) == path.end()) {
+    path.push_back(pkg);
+    for (auto dp : pkg->deps) {
+      if (ndeps[index[dp]] != 0) {
+        pkg = dp;
+        break;
+      }
+    }
+  }
+  std::string msg = "import cycle: " + pkg->path;
+  for (auto it = std::find(path.begin(), path.end(), pkg) + 1; it != path.end(); ++it) {
+    msg += " -> " + (*it)->path;
+  }
+  return Err(msg + " -> " + pkg->path);
+}
+
+
+Err buildPackages(Packages& pkgs, IStr::SharedSet& strings, unsigned jobs,
+                  BuildStats& stats, const AstCache* cache,
+                  const OutputCache* outcache, const PackageStore* store) {
+  uint64_t startTime = nanotime();
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Scan the package clause and imports of all files at once
+  std::vector<std::pair<Package*,size_t>> units;
+  for (auto& pkg : pkgs) {
+    Err err = listPackage(*pkg);
+    if (err) {
+      return err;
+    }
+    for (size_t i = 0; i != pkg->filenames.size(); ++i) {
+      units.emplace_back(pkg.get(), i);
+    }
+  }
+  parallelFor(units.size(), jobs, [&](size_t i) {
+    auto pkg = units[i].first;
+    scanUnit(pkg->units[units[i].second], pkg->filenames[units[i].second].c_str(),
+             cache != nullptr || outcache != nullptr || store != nullptr);
+  });
+
+  // Imports form the dependency graph
+  bool failed = false;
+  for (auto& pkg : pkgs) {
+    for (size_t i = 0; i != pkg->filenames.size(); ++i) {
+      auto& u = pkg->units[i];
+      if (u.err) {
+        if (!pkg->err) {
+          pkg->err = u.err;
+          pkg->errunit = &u;
+        }
+        failed = true;
+        continue;
+      }
+      for (auto& imp : u.header.imports) {
+        auto dep = findPackage(pkgs, imp.path);
+        if (dep != nullptr &&
+            std::find(pkg->deps.begin(), pkg->deps.end(), dep) == pkg->deps.end())
+        {
+          pkg->deps.push_back(dep);
+          dep->dependents.push_back(pkg.get());
+        }
+      }
+    }
+  }
+  if (failed) {
+    return Err("build failed");
+  }
+  std::vector<Package*> order;
+  Err err = topoSort(pkgs, order);
+  if (err) {
+    return err;
+  }
+  if (outcache != nullptr || store != nullptr) {
+    // A store uses the same keys as an OutputCache
+    OutputCache keys;
+    keys.build = compilerId();
+    for (auto pkg : order) {
+      pkg->key = packageKey(*pkg, outcache != nullptr ? *outcache : keys);
+    }
+  }
+
+  // Build packages as soon as their dependencies are done. A package which
+  // becomes ready is queued as a task to start it, which queues a task to
+  // parse each of its units, so that the units of one package are parsed
+  // by all threads at once. Whichever thread parses the last unit merges
+  // them and generates code, and then makes ready any dependents that were
+  // only waiting for this package.
+  struct Task {
+    Package* pkg;
+    size_t   unit; // index of unit to parse, or kStart
+  };
+  const size_t kStart = SIZE_MAX;
+  std::mutex mu;
+  std::condition_variable cond;
+  std::deque<Task> ready;
+  std::map<Package*,size_t> waiting;  // number of dependencies not yet built
+  std::map<Package*,size_t> unparsed; // number of units not yet parsed
+  size_t ndone = 0;
+  size_t nunits = 0;
+  for (auto& pkg : pkgs) {
+    waiting[pkg.get()] = pkg->deps.size();
+    if (pkg->deps.empty()) {
+      ready.push_back({pkg.get(), kStart});
+    }
+    nunits += pkg->filenames.size();
+  }
+
+  // Called with mu locked when pkg is built, found in the cache or skipped
+  auto finish = [&](Package* pkg) {
+    ++ndone;
+    for (auto dp : pkg->dependents) {
+      if (pkg->err || pkg->skipped) {
+        dp->skipped = true;
+      }
+      if (--waiting[dp] == 0) {
+        ready.push_back({dp, kStart});
+      }
+    }
+    cond.notify_all();
+  };
+
+  auto work = [&] {
+    std::unique_lock<std::mutex> lock(mu);
+    while (1) {
+      cond.wait(lock, [&] { return !ready.empty() || ndone == pkgs.size(); });
+      if (ready.empty()) {
+        return;
+      }
+      auto task = ready.front();
+      auto pkg = task.pkg;
+      ready.pop_front();
+
+      if (task.unit == kStart) {
+        if (pkg->skipped) {
+          finish(pkg);
+          continue;
+        }
+        lock.unlock();
+        pkg->startTime = nanotime() - startTime;
+        bool found = findStoredPackage(*pkg, store) ||
+                     findCachedPackage(*pkg, strings, outcache);
+        bool empty = pkg->filenames.empty();
+        if (found || empty) {
+          if (!found) {
+            finishPackage(*pkg, outcache);
+          }
+          pkg->endTime = nanotime() - startTime;
+          lock.lock();
+          finish(pkg);
+          continue;
+        }
+        lock.lock();
+        unparsed[pkg] = pkg->filenames.size();
+        for (size_t i = 0; i != pkg->filenames.size(); ++i) {
+          ready.push_back({pkg, i});
+        }
+        cond.notify_all();
+        continue;
+      }
+
+      lock.unlock();
+      parseScannedUnit(pkg->units[task.unit], strings, cache);
+      lock.lock();
+      if (--unparsed[pkg] == 0) {
+        lock.unlock();
+        finishPackage(*pkg, outcache);
+        pkg->endTime = nanotime() - startTime;
+        lock.lock();
+        finish(pkg);
+      }
+    }
+  };
+
+  stats.threads = (unsigned)std::max(size_t(1), std::min(size_t(jobs), nunits));
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < stats.threads; ++t) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& t : threads) {
+    t.join();
+  }
+  stats.wallTime = nanotime() - startTime;
+  for (auto& pkg : pkgs) {
+    if (pkg->warm) {
+      ++stats.warmPackages;
+      continue;
+    }
+    if (pkg->cached) {
+      ++stats.cachedPackages;
+      continue;
+    }
+    if (pkg->skipped) {
+      continue;
+    }
+    ++stats.builtPackages;
+    for (size_t i = 0; i != pkg->filenames.size(); ++i) {
+      ++stats.units;
+      stats.cachedUnits += pkg->units[i].cached;
+    }
+  }
+
+  // Critical path, i.e. the chain of dependencies that took the longest to
+  // build. No amount of threads can make the build faster than that.
+  Package* critEnd = nullptr;
+  for (auto pkg : order) {
+    uint64_t duration = pkg->endTime - pkg->startTime;
+    stats.workTime += duration;
+    pkg->critTime = duration;
+    for (auto dep : pkg->deps) {
+      if (dep->critTime + duration > pkg->critTime) {
+        pkg->critTime = dep->critTime + duration;
+        pkg->critPrev = dep;
+      }
+    }
+    if (critEnd == nullptr || pkg->critTime > critEnd->critTime) {
+      critEnd = pkg;
+    }
+    if (pkg->err || pkg->skipped) {
+      failed = true;
+    }
+  }
+  if (critEnd != nullptr) {
+    stats.critTime = critEnd->critTime;
+    for (auto pkg = critEnd; pkg != nullptr; pkg = pkg->critPrev) {
+      stats.critPath.insert(stats.critPath.begin(), pkg);
+    }
+  }
+
+  return failed ? Err("build failed") : Err::OK();
+}
+
+} // namespace build
@@ -0,0 +1,230 @@
+#pragma once
+#include "astcache.h"
+#include "depscan.h"
+#include "parse.h"
+#include "wasm.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Compiling the source files of a package, and of several packages.
+//
+// Each file is a Unit which is loaded, validated and parsed on its own, with
+// its own Module and AST allocator, so that units can be built concurrently.
+// The units are then merged into the package's Module one at a time, in the
+// order they were given, which makes the result independent of how the work
+// was scheduled.
+//
+//   std::unique_ptr<build::Unit[]> units{new build::Unit[n]};
+//   build::parallelFor(n, jobs, [&](size_t i) {
+//     build::parseUnit(units[i], filenames[i], strings);
+//   });
+//   for (size_t i = 0; i != n; ++i) {
+//     err = units[i].err ? units[i].err : build::mergeUnit(mod, prog, units[i]);
+//     ...
+//   }
+//
+namespace build {
+
+// Source of a file, mapped or read into memory
+struct SrcFile {
+  std::string name;    // as given, or "<stdin>"
+  const char* p = nullptr;
+  size_t      size = 0;
+  bool        mapped = false;
+
+  // Loads `filename`, or stdin when filename is null.
+  // Errors have code 0 and a message from errno.
+  Err load(const char* filename);
+
+  SrcFile() {}
+  ~SrcFile();
+private:
+  SrcFile(const SrcFile&) = delete;
+};
+
+// A translation unit; one source file of a package
+struct Unit {
+  SrcFile      src;
+  Module       mod;      // declarations of this unit only
+  AstAllocator astalloc; // owns all nodes of this unit
+  AstPkgDecl   pkgdecl;
+  Imports      imps;
+  AstNode*     prog = nullptr;
+  DepScan      header;   // from scanUnit
+  bool         cached = false; // AST was loaded from an AstCache
+
+  // wyhash128 of src, which the keys of both caches are made from. Computed
+  // once, when hashed is false and a cache is used.
+  hash::B16    srchash{};
+  bool         hashed = false;
+
+  // Error from loading or parsing, and where in src it happened
+  Err          err;
+  SrcLoc       errloc;
+};
+
+// Loads and parses a unit. Safe to call concurrently for different units
+// that share `strings`. On failure u.err and u.errloc are set.
+// With a cache, a unit whose source is in the cache is loaded from there
+// instead of being parsed, and other units are stored after parsing.
+void parseUnit(Unit& u, const char* filename, IStr::SharedSet& strings,
+               const AstCache* cache = nullptr);
+
+// parseUnit in two steps: scanUnit loads the unit and reads only its package
+// clause and imports into u.header, using depscan. parseScannedUnit then
+// parses the unit in full. With withHash, scanUnit also sets u.srchash, so
+// that the whole source is read by the thread scanning it.
+void scanUnit(Unit& u, const char* filename, bool withHash = false);
+void parseScannedUnit(Unit& u, IStr::SharedSet& strings,
+                      const AstCache* cache = nullptr);
+
+// Adds the top-level declarations of `u` to the package module `mod` and
+// moves them to the end of the package program `prog`. Returns an error if
+// a name is already declared by a unit merged earlier or if the unit
+// belongs to a different package, in which case u.errloc is set.
+// Nodes stay owned by u.astalloc.
+Err mergeUnit(Module& mod, AstNode& prog, Unit& u);
+
+// Calls fn(i) for every i in [0,n) using up to `jobs` threads, including the
+// calling thread. Returns when all calls have returned. jobs=0 means one
+// thread per CPU.
+void parallelFor(size_t n, unsigned jobs, const std::function<void(size_t)>& fn);
+
+// Identity of the running compiler: a hash of its executable, computed once.
+// Mixed into the keys of cached results so that results of any other build
+// of cox, e.g. one with a changed parser, are never used.
+const hash::B16& compilerId();
+
+
+// On-disk store of generated code. An entry is named after a hash of all
+// inputs of the package it was generated from, so it's only ever found again
+// when nothing that affects the code has changed. Those inputs are the
+// sources, the code of dependencies and the compiler itself; there are no
+// options which affect code generation, and build settings of cox are part
+// of its identity.
+struct OutputCache {
+  std::string dir;      // where entries are stored; must exist
+  hash::B16   build{};  // identity of the compiler (see compilerId)
+
+  // Key of code generated from n units, merged in that order, which import
+  // packages with the ndeps keys at depkeys
+  hash::B16 key(const Unit* units, size_t n, const hash::B16* depkeys, size_t ndeps) const;
+
+  // Path of the entry for key, i.e. dir/KEY.wasm
+  std::string filename(const hash::B16& key) const;
+  bool has(const hash::B16& key) const;
+
+  // Stores code as the entry for key, replacing any existing entry
+  Err store(const hash::B16& key, const wasm::Buf&) const;
+};
+
+
+// A package directory; all *.co files in it make up one package.
+struct Package {
+  std::string dir;   // as given
+  std::string path;  // import path, i.e. dir without "./" and trailing "/"
+  std::vector<std::string> filenames; // source files, sorted
+  std::unique_ptr<Unit[]>  units;     // one per filename
+
+  Module       mod;      // declarations of all units
+  AstAllocator astalloc;
+  AstNode*     prog = nullptr; // declarations of all units
+  wasm::Buf    wasm;     // generated code
+
+  // With an OutputCache, the key of the package's code (see OutputCache::key.)
+  // When cached is true, the package was not built as its code was found in
+  // the OutputCache under this key, and `wasm` is empty.
+  hash::B16    key;
+  bool         cached = false;
+
+  // With a PackageStore, the package as an earlier build built it, when it
+  // was found in the store under `key`. Its module, AST and code are used
+  // instead of building this package, which then has only mod.name.
+  std::shared_ptr<const Package> warm;
+
+  std::vector<Package*> deps;       // packages imported by this one
+  std::vector<Package*> dependents; // packages which import this one
+
+  // Error from building this package. If a unit failed, errunit is that
+  // unit and the error is also in errunit->err. skipped is true when the
+  // package wasn't built because one of its dependencies failed.
+  Err   err;
+  Unit* errunit = nullptr;
+  bool  skipped = false;
+
+  // When this package was built, in nanoseconds since the build started,
+  // and the longest chain of dependencies ending with this package.
+  uint64_t startTime = 0;
+  uint64_t endTime = 0;
+  uint64_t critTime = 0;         // duration of the chain, including this package
+  Package* critPrev = nullptr;   // previous package in the chain
+};
+
+struct BuildStats {
+  uint64_t wallTime = 0;  // nanoseconds from start to end of the build
+  uint64_t workTime = 0;  // sum of time spent building each package
+  uint64_t critTime = 0;  // time of the longest chain of dependencies
+  std::vector<Package*> critPath; // that chain, starting with a leaf
+  unsigned threads = 0;
+  size_t   warmPackages = 0;   // number of packages found in the PackageStore
+  size_t   cachedPackages = 0; // number of packages found in the OutputCache
+  size_t   builtPackages = 0;  // number of packages that had to be built
+  size_t   units = 0;          // number of source files of those
+  size_t   cachedUnits = 0;    // number of those loaded from the AST cache
+};
+
+using Packages = std::vector<std::unique_ptr<Package>>;
+
+// Packages kept in memory between builds by a long-running process, i.e. a
+// server, so that a package which hasn't changed since it was last built is
+// not parsed again. Packages are found by their OutputCache key and keep
+// their units, module, AST and code, and the allocators these live in.
+// Up to maxPackages are kept, dropping the oldest to make room. Safe to use
+// from several builds at once.
+struct PackageStore {
+  size_t maxPackages = 128;
+
+  // The package stored under key, or null
+  std::shared_ptr<const Package> find(const hash::B16& key) const;
+
+  // Moves the packages of pkgs which were built without errors to the
+  // store, leaving null in their place, and clears their links to other
+  // packages. Call when done with pkgs.
+  void keep(Packages& pkgs);
+
+private:
+  mutable std::mutex _mu;
+  std::map<std::string,std::shared_ptr<const Package>> _pkgs; // by key
+  std::deque<std::string> _order; // keys, oldest first
+};
+
+// Builds several packages which may import each other.
+//
+// First the package clause and imports of every file are scanned, all at
+// once. Imports of paths which name one of `pkgs` are dependencies; other
+// imports are assumed to be satisfied elsewhere. Packages are then built on
+// up to `jobs` threads, each as soon as all of its dependencies are built,
+// so that independent packages are built at the same time. The units of a
+// package are parsed concurrently and merged in order.
+//
+// Returns an error if any package failed, in which case their `err` is set.
+// An import cycle is reported as an error of the build itself.
+// Units are parsed with `cache`, if any, like parseUnit does.
+//
+// With an OutputCache, packages whose code is in the cache are not parsed
+// or built at all, and the code of other packages is stored once they are
+// built. With a PackageStore, packages found in it are not built either,
+// and are not looked up in the OutputCache; their keys are computed even
+// without an OutputCache. Packages in the store must have been built with
+// the same `strings`.
+Err buildPackages(Packages& pkgs, IStr::SharedSet& strings, unsigned jobs,
+                  BuildStats& stats, const AstCache* cache = nullptr,
+                  const OutputCache* outcache = nullptr,
+                  const PackageStore* store = nullptr);
+
+} // namespace build
@@ -0,0 +1,158 @@
+// Vectorized byte scanning.
+//
+// Finds the first occurrence of any of a small set of bytes, 32 (AVX2) or
+// 16 (SSE2) bytes at a time, with a scalar loop for the tail and for targets
+// without SIMD. Used by the lexer to skip over comment and literal bodies.
+//
+//   // find end of line comment
+//   p = bytescan::findAny(p, end, '\n');
+//   // find next interesting byte of a string literal
+//   p = bytescan::findAnyOrSpecial(p, end, '"', '\\');
+//
+#pragma once
+#include <stdint.h>
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+namespace bytescan {
+
+// Returns a pointer to the first byte in [p,end) that is equal to any of
+// `bytes`, or end if there's no such byte.
+template <typename... Bytes>
+const char* findAny(const char* p, const char* end, Bytes... bytes);
+
+// Like findAny, but also stops at any "special" byte, i.e. a byte that is not
+// printable ASCII: control characters, DEL and bytes of multibyte UTF-8 sequences.
+template <typename... Bytes>
+const char* findAnyOrSpecial(const char* p, const char* end, Bytes... bytes);
+
+// Returns a pointer to the first byte in [p,end) that is not ASCII (i.e. has
+// its high bit set), or end if there's no such byte.
+const char* findNonASCII(const char* p, const char* end);
+
+
+// -----------------------------------------------------------------------------------------------
+// Implementation
+
+namespace detail {
+
+inline bool eq(char) { return false; }
+template <typename... Rest>
+inline bool eq(char c, char b, Rest... rest) { return c == b || eq(c, rest...); }
+
+inline bool isSpecial(char c) {
+  return (uint8_t)c < 0x20 || (uint8_t)c >= 0x7f;
+}
+
+#if defined(__AVX2__)
+inline __m256i eq32(__m256i) { return _mm256_setzero_si256(); }
+template <typename... Rest>
+inline __m256i eq32(__m256i v, char b, Rest... rest) {
+  return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(b)), eq32(v, rest...));
+}
+inline __m256i special32(__m256i v) {
+  // Signed compare: bytes >= 0x80 are negative and thus also "less than" 0x20
+  return _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+}
+#endif
+
+#if defined(__SSE2__)
+inline __m128i eq16(__m128i) { return _mm_setzero_si128(); }
+template <typename... Rest>
+inline __m128i eq16(__m128i v, char b, Rest... rest) {
+  return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(b)), eq16(v, rest...));
+}
+inline __m128i special16(__m128i v) {
+  return _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                      _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+}
+#endif
+
+template <bool StopAtSpecial, typename... Bytes>
+inline const char* find(const char* p, const char* end, Bytes... bytes) {
+  #if defined(__AVX2__)
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i m = eq32(v, bytes...);
+    if (StopAtSpecial) {
+      m = _mm256_or_si256(m, special32(v));
+    }
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  #endif
+  #if defined(__SSE2__)
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i m = eq16(v, bytes...);
+    if (StopAtSpecial) {
+      m = _mm_or_si128(m, special16(v));
+    }
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(m);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  #endif
+  for (; p != end; ++p) {
+    if (eq(*p, bytes...) || (StopAtSpecial && isSpecial(*p))) {
+      return p;
+    }
+  }
+  return end;
+}
+
+inline const char* findNonASCII(const char* p, const char* end) {
+  // Only the sign bit of each byte matters, so no compare is needed
+  #if defined(__AVX2__)
+  while (end - p >= 32) {
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)p));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  #endif
+  #if defined(__SSE2__)
+  while (end - p >= 16) {
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  #endif
+  for (; p != end; ++p) {
+    if ((uint8_t)*p >= 0x80) {
+      return p;
+    }
+  }
+  return end;
+}
+
+} // namespace detail
+
+
+template <typename... Bytes>
+inline const char* findAny(const char* p, const char* end, Bytes... bytes) {
+  return detail::find<false>(p, end, char(bytes)...);
+}
+
+template <typename... Bytes>
+inline const char* findAnyOrSpecial(const char* p, const char* end, Bytes... bytes) {
+  return detail::find<true>(p, end, char(bytes)...);
+}
+
+inline const char* findNonASCII(const char* p, const char* end) {
+  return detail::findNonASCII(p, end);
+}
+
+} // namespace bytescan
@@ -1,20 +1,31 @@
+#include "build.h"
 #include "parse.h"
 #include "readfile.h"
+#include "server.h"
+#include "text.h"
 #include "wasm.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <err.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-using std::cout;
-using std::cerr;
 using std::endl;
 using std::string;
 
-string getSrcCtx(const char* srcp, size_t srcz, const SrcLoc& loc, size_t n) {
+string getSrcCtx(const char* srcp, size_t srcz, const SrcLoc& loc, const SrcPos& pos,
+                 size_t n) {
   const char* endp = srcp + srcz;
-  const char* p = srcp + loc.offset;
+  // An error at the end of input, e.g. an unexpected End token, has an offset
+  // of srcz. Sources are mapped, so there are no bytes to read past the end.
+  const char* p = loc.offset < srcz ? srcp + loc.offset : endp - 1;
   const char* ctxbeginaddlp = srcp;   // beginning of additional lines
   const char* ctxbeginp = srcp;       // beginning of interesting line
   const char* ctxendp = endp;
@@ -50,7 +61,7 @@ string getSrcCtx(const char* srcp, size_t srcz, const SrcLoc& loc, size_t n) {
 
   // append "pointer" (i.e. ~~~^)
   s += "\n";
-  for (size_t col = 0; col != loc.column; ++col) {
+  for (size_t col = 0; col != pos.column; ++col) {
     s += ' ';
   }
   if (loc.length > 1) {
@@ -65,113 +76,475 @@ string getSrcCtx(const char* srcp, size_t srcz, const SrcLoc& loc, size_t n) {
 }
 
 
-void reportParseErr(Parser& p, const Err& err, const char* srcp, size_t srcz) {
-  cerr << "parse error: " << err.message();
-  if (err.code() == ParseErrSyntax) {
-    auto& loc = p.srcLoc();
-    cerr << " at " << (loc.line+1) << ":" << (loc.column+1);
-    if (srcp != nullptr) {
-      auto sctx = getSrcCtx(srcp, srcz, loc, 1);
-      cerr << "\n" << sctx;
+// Where a command writes its output: stdout and stderr, or the connection of
+// a client when run by a server (cox --serve)
+struct Console {
+  std::ostream& out;
+  std::ostream& err;
+};
+
+
+void reportParseErr(Console& con, const Err& err, const SrcLoc& loc,
+                    const build::SrcFile& src) {
+  con.err << src.name << ": ";
+  if (err.code() == ParseErrSyntax || err.code() == ParseErrEncoding) {
+    con.err << "parse error: " << err.message();
+    if (src.p != nullptr) {
+      auto pos = SrcLines{src.p, src.size}.pos(loc);
+      con.err << " at " << (pos.line+1) << ":" << (pos.column+1);
+      auto sctx = getSrcCtx(src.p, src.size, loc, pos, 1);
+      con.err << "\n" << sctx;
     }
+  } else if (err.code() == ParseErr) {
+    con.err << "parse error: " << err.message();
+  } else {
+    con.err << err.message();
   }
-  cerr << endl;
-  exit(1);
+  con.err << endl;
 }
 
-int main(int argc, char const *argv[]) {
-  // Read input from stdin or a file
-  FILE* f = stdin;
-  if ((argc > 1) && !(f = fopen(argv[1], "r"))) {
-    err(1, "%s", argv[0]);
+
+// Reports the system error of the last failed call, e.g. "foo.wasm: No such
+// file or directory". Returns the exit status to use.
+static int reportErrno(Console& con, const string& what) {
+  con.err << what << ": " << strerror(errno) << endl;
+  return 1;
+}
+
+
+void printImports(std::ostream& out, const Imports& imps) {
+  if (imps.empty()) {
+    out << "no imports" << endl;
+    return;
   }
-  size_t srcz = 0;
-  char* srcp = readfile(f, srcz, 102400000);
-  if (!srcp) {
-    err(1, "%s", argv[0]);
+  out << "imports: " << endl;
+  for (auto& e : imps) {
+    out << "  \"" << e.first << "\"";
+    size_t n = 0;
+    for (auto& imp : e.second) {
+      out << (++n == 1 ? " as " : ", ");
+      if (imp.name == nullptr) {
+        out << "?";
+      } else {
+        out << imp.name->value.str; // TODO: ast_repr
+      }
+    }
+    out << endl;
   }
-  fclose(f); f = nullptr;
+}
 
-  // We use these for the entire thread memory space
-  IStr::WeakSet strings;  // string interning
-  AstAllocator  astalloc; // AST allocator
 
-  // We use this for the entire module
-  Module module;
+int usage(Console& con, const string& prog) {
+  con.err << "usage: " << prog << " [-j N] [-c CACHEDIR] [--stats] [-o OUTFILE] [FILE ...]\n"
+          "       " << prog << " -P [-j N] [-c CACHEDIR] [--stats] [-o OUTDIR] DIR ...\n"
+          "       " << prog << " -M [-j N] FILE ...\n"
+          "       " << prog << " --serve SOCKET\n"
+          "       " << prog << " --connect SOCKET [ARG ...]\n"
+          "Compiles the source files of one package, or stdin if no FILEs\n"
+          "are given. Files are parsed concurrently on N threads (default:\n"
+          "one per CPU.) With -o, WASM code is written to OUTFILE.\n"
+          "With -P, each DIR is a package and packages are built in order of\n"
+          "their imports. With -o, WASM code of each package is written to\n"
+          "OUTDIR/DIRNAME.wasm.\n"
+          "With -M, only the package clause and imports of each FILE are\n"
+          "read, and printed as \"FILE: PACKAGE IMPORT...\"\n"
+          "With -c, parsed files are cached in CACHEDIR and files which\n"
+          "haven't changed since are loaded from there instead of parsed.\n"
+          "Generated code is cached there as well and reused when no source\n"
+          "has changed. With -P, such packages are not even parsed, and so\n"
+          "are not built at all. --stats prints how often the caches were\n"
+          "used.\n"
+          "With --serve, cox keeps running as a compile server listening on\n"
+          "SOCKET. With --connect, the command given by ARGs is run by the\n"
+          "server at SOCKET instead of in a new process. stdin can not be\n"
+          "compiled this way. The server keeps packages it built with -P in\n"
+          "memory, and packages which haven't changed since are not built\n"
+          "again. Only the user who started the server can connect to it,\n"
+          "and files are read and written by the server.\n";
+  return 1;
+}
 
-  // We use these for one translation unit
-  Err    error;
-  Parser p(srcp, srcz, strings, module);
 
-  // package
-  AstPkgDecl pkgdecl;
-  error = p.parsePkgDecl(pkgdecl);
-  if (!error.ok()) {
-    reportParseErr(p, error, srcp, srcz);
+static double millis(uint64_t ns) {
+  return double(ns) / 1000000.0;
+}
+
+
+static void printHitRate(std::ostream& out, const char* what, size_t hits, size_t total,
+                         const char* unit) {
+  out << what << ": " << hits << " of " << total << " " << unit << " ("
+      << (total == 0 ? 0 : (hits * 100 + total / 2) / total) << "% hit rate)" << endl;
+}
+
+
+// Writes size bytes at p to filename
+static bool writeOutput(const string& filename, const void* p, size_t size) {
+  FILE* of = fopen(filename.c_str(), "w");
+  if (of == nullptr) {
+    return false;
   }
-  cout << "package: " << pkgdecl.name << endl;
-  if (!pkgdecl.doc.empty()) {
-    cout << pkgdecl.doc << endl;
+  bool ok = fwrite(p, size, 1, of) == 1;
+  int e = errno;
+  if (fclose(of) != 0) {
+    return false;
   }
+  errno = e;
+  return ok;
+}
 
-  // imports
-  Imports imps;
-  error = p.parseImports(astalloc, imps);
-  if (!error.ok()) {
-    reportParseErr(p, error, srcp, srcz);
+
+// Prints the package and imports of source files (cox -M)
+int mainDeps(Console& con, const std::vector<string>& filenames, unsigned jobs) {
+  size_t nunits = filenames.size();
+  std::unique_ptr<build::Unit[]> units{new build::Unit[nunits]};
+  build::parallelFor(nunits, jobs, [&](size_t i) {
+    build::scanUnit(units[i], filenames[i].c_str());
+  });
+  for (size_t i = 0; i != nunits; ++i) {
+    auto& u = units[i];
+    if (u.err) {
+      reportParseErr(con, u.err, u.errloc, u.src);
+      return 1;
+    }
+    con.out << u.src.name << ": " << u.header.pkgname;
+    for (auto& imp : u.header.imports) {
+      con.out << " \"" << text::repr(imp.path) << '"';
+    }
+    con.out << endl;
   }
-  if (imps.empty()) {
-    cout << "no imports" << endl;
-  } else {
-    cout << "imports: " << endl;
-    for (auto& e : imps) {
-      cout << "  \"" << e.first << "\"";
-      size_t n = 0;
-      for (auto& imp : e.second) {
-        cout << (++n == 1 ? " as " : ", ");
-        if (imp.name == nullptr) {
-          cout << "?";
-        } else {
-          cout << imp.name->value.str; // TODO: ast_repr
-        }
+  return 0;
+}
+
+
+// Name of the file which the code of the package in dir is written to, i.e.
+// DIRNAME.wasm
+static string outputName(const string& dir) {
+  size_t end = dir.find_last_not_of('/') + 1;
+  size_t slash = dir.rfind('/', end == 0 ? 0 : end - 1);
+  size_t begin = slash == string::npos || end == 0 ? 0 : slash + 1;
+  return dir.substr(begin, end - begin) + ".wasm";
+}
+
+
+// Reports the first package that failed, but not those that were skipped
+// because of it
+static void reportBuildErr(Console& con, const build::Packages& pkgs, const Err& error) {
+  for (auto& pkg : pkgs) {
+    if (pkg->errunit != nullptr) {
+      reportParseErr(con, pkg->err, pkg->errunit->errloc, pkg->errunit->src);
+      return;
+    } else if (pkg->err) {
+      con.err << pkg->path << ": " << pkg->err.message() << endl;
+      return;
+    }
+  }
+  con.err << error.message() << endl;
+}
+
+
+// Builds several package directories (cox -P). With a store, packages are
+// looked up there and kept there once built.
+int mainPackages(Console& con, IStr::SharedSet& strings, const std::vector<string>& dirs,
+                 const char* outdir, unsigned jobs, const AstCache* cache,
+                 const build::OutputCache* outcache, build::PackageStore* store,
+                 bool showStats) {
+  // Packages in different directories with the same name, e.g. a/util and
+  // b/util, would write the same output file
+  if (outdir != nullptr) {
+    std::map<string,const string*> names;
+    for (auto& dir : dirs) {
+      auto r = names.emplace(outputName(dir), &dir);
+      if (!r.second) {
+        con.err << *r.first->second << ", " << dir << ": both would be written to "
+                << outdir << "/" << r.first->first << endl;
+        return 1;
       }
-      cout << endl;
     }
   }
 
-  // AST
+  build::Packages pkgs;
+  for (auto& dir : dirs) {
+    pkgs.emplace_back(new build::Package);
+    pkgs.back()->dir = dir;
+  }
+
+  build::BuildStats stats;
+  Err error = build::buildPackages(pkgs, strings, jobs, stats, cache, outcache, store);
+  if (error) {
+    reportBuildErr(con, pkgs, error);
+    if (store != nullptr) {
+      store->keep(pkgs); // packages that did build are still good
+    }
+    return 1;
+  }
+
+  for (auto& pkg : pkgs) {
+    con.out << "package " << pkg->mod.name << " (" << pkg->path << "): "
+            << pkg->filenames.size() << " files, " << pkg->deps.size() << " imports, "
+            << millis(pkg->endTime - pkg->startTime) << " ms"
+            << (pkg->warm ? ", warm" : pkg->cached ? ", cached" : "") << endl;
+    if (outdir != nullptr) {
+      string filename = string(outdir) + "/" + outputName(pkg->dir);
+      const wasm::Buf& code = pkg->warm ? pkg->warm->wasm : pkg->wasm;
+      bool ok = pkg->cached ?
+        cpfile(outcache->filename(pkg->key).c_str(), filename.c_str()) :
+        writeOutput(filename, code.data(), code.size());
+      if (!ok) {
+        return reportErrno(con, filename);
+      }
+    }
+  }
+
+  con.out << "critical path: " << millis(stats.critTime) << " ms";
+  for (size_t i = 0; i != stats.critPath.size(); ++i) {
+    con.out << (i == 0 ? " (" : " -> ") << stats.critPath[i]->path;
+  }
+  con.out << (stats.critPath.empty() ? "" : ")") << endl;
+  con.out << "wall time: " << millis(stats.wallTime) << " ms, "
+          << "build time: " << millis(stats.workTime) << " ms on "
+          << stats.threads << " threads" << endl;
+  if (showStats) {
+    printHitRate(con.out, "ast cache", stats.cachedUnits, stats.units, "files");
+    printHitRate(con.out, "output cache", stats.cachedPackages,
+                 stats.cachedPackages + stats.builtPackages, "packages");
+    if (store != nullptr) {
+      printHitRate(con.out, "warm packages", stats.warmPackages, pkgs.size(), "packages");
+    }
+  }
+  if (store != nullptr) {
+    store->keep(pkgs);
+  }
+  return 0;
+}
+
+
+// Compiles the files of one package, or stdin if filenames is empty
+int mainUnits(Console& con, IStr::SharedSet& strings, const std::vector<string>& filenames,
+              const char* outfile, unsigned jobs, const AstCache* cache,
+              const build::OutputCache* outcache, bool showStats) {
+  // Load and parse all files concurrently. Each file has its own module and
+  // AST allocator, and errors are reported in file order below so that
+  // output doesn't depend on scheduling.
+  size_t nunits = filenames.empty() ? 1 : filenames.size();
+  std::unique_ptr<build::Unit[]> units{new build::Unit[nunits]};
+  build::parallelFor(nunits, jobs, [&](size_t i) {
+    const char* filename = filenames.empty() ? nullptr : filenames[i].c_str();
+    build::parseUnit(units[i], filename, strings, cache);
+  });
+
+  // We use this for the entire package
+  Module module;
+  AstAllocator astalloc;
   auto prog = astalloc.alloc();
   prog->type = AstProgram;
-  error = p.parseProgram(astalloc, *prog);
-  if (!error.ok()) {
-    reportParseErr(p, error, srcp, srcz);
+
+  // Merge units in file order
+  for (size_t i = 0; i != nunits; ++i) {
+    auto& u = units[i];
+    if (u.err) {
+      reportParseErr(con, u.err, u.errloc, u.src);
+      return 1;
+    }
+    Err error = build::mergeUnit(module, *prog, u);
+    if (error) {
+      reportParseErr(con, error, u.errloc, u.src);
+      return 1;
+    }
+  }
+
+  // package
+  con.out << "package: " << module.name << endl;
+  for (size_t i = 0; i != nunits; ++i) {
+    auto& u = units[i];
+    if (!u.pkgdecl.doc.empty()) {
+      con.out << u.pkgdecl.doc << endl;
+    }
   }
-  ast_repr(*prog, cout) << endl;
 
-  // WASM codegen
+  // imports
+  for (size_t i = 0; i != nunits; ++i) {
+    if (nunits > 1) {
+      con.out << units[i].src.name << ": ";
+    }
+    printImports(con.out, units[i].imps);
+  }
+
+  // AST
+  ast_repr(*prog, con.out) << endl;
+
+  // WASM codegen, unless the code is in the output cache. The AST is
+  // printed above, so the units are parsed (or loaded) either way.
   wasm::Buf wbuf;
-  error = wasm::emit_module(wbuf, *prog);
-  if (!error.ok()) {
-    cerr << "genwasm: " << error.message() << endl;
-    abort();
+  hash::B16 key;
+  bool cachedCode = false;
+  if (outcache != nullptr) {
+    key = outcache->key(units.get(), nunits, nullptr, 0);
+    cachedCode = outcache->has(key);
+  }
+  if (!cachedCode) {
+    Err error = wasm::emit_module(wbuf, *prog);
+    if (!error.ok()) {
+      con.err << "genwasm: " << error.message() << endl;
+      return 1;
+    }
+    if (outcache != nullptr) {
+      // Failing to store only makes the next build slower
+      outcache->store(key, wbuf);
+    }
   }
 
   // Write output
-  if (argc > 2) {
-    FILE* of = fopen(argv[2], "w");
-    if (of == nullptr) {
-      err(1, "%s", argv[0]);
+  if (outfile != nullptr) {
+    con.out << "write WASM code to " << outfile << endl;
+    bool ok = cachedCode ?
+      cpfile(outcache->filename(key).c_str(), outfile) :
+      writeOutput(outfile, wbuf.data(), wbuf.size());
+    if (!ok) {
+      return reportErrno(con, outfile);
+    }
+  }
+
+  if (showStats) {
+    size_t cached = 0;
+    for (size_t i = 0; i != nunits; ++i) {
+      cached += units[i].cached;
+    }
+    printHitRate(con.out, "ast cache", cached, nunits, "files");
+    printHitRate(con.out, "output cache", cachedCode, 1, "packages");
+  }
+  return 0;
+}
+
+
+// Runs one cox command. args[0] is the program name. When run by a server,
+// cwd is the working directory of the client which relative paths are
+// resolved against, stdin is not available, and packages built with -P are
+// kept in store, which holds strings of `strings`. Returns the exit status.
+int run(Console& con, IStr::SharedSet& strings, build::PackageStore* store,
+        const std::vector<string>& args, const string& cwd) {
+  auto path = [&](const string& p) {
+    return cwd.empty() || p.empty() || p[0] == '/' ? p : cwd + "/" + p;
+  };
+  std::vector<string> filenames;
+  string outfile;
+  string cachedir;
+  bool showStats = false;
+  unsigned jobs = 0;
+  bool packages = false;
+  bool deps = false;
+  string prog = args.empty() ? "cox" : args[0];
+  for (size_t i = 1; i < args.size(); ++i) {
+    const string& arg = args[i];
+    if (arg == "-P") {
+      packages = true;
+    } else if (arg == "-M") {
+      deps = true;
+    } else if ((arg == "-o" || arg == "-j" || arg == "-c") && i + 1 == args.size()) {
+      return usage(con, prog);
+    } else if (arg == "-o") {
+      outfile = path(args[++i]);
+    } else if (arg == "-c") {
+      cachedir = path(args[++i]);
+    } else if (arg == "--stats") {
+      showStats = true;
+    } else if (arg == "-j") {
+      jobs = (unsigned)atoi(args[++i].c_str());
+      if (!cwd.empty()) {
+        // a server runs several commands at once, so no more than one per CPU
+        jobs = std::min(jobs, std::max(1u, std::thread::hardware_concurrency()));
+      }
+    } else if (arg == "-h" || arg == "--help" || (arg.size() > 1 && arg[0] == '-')) {
+      return usage(con, prog);
+    } else {
+      filenames.push_back(path(arg));
+    }
+  }
+  AstCache cache;
+  if (!cachedir.empty()) {
+    cache.dir = cachedir;
+    cache.build = build::compilerId();
+    if (mkdir(cachedir.c_str(), 0777) != 0 && errno != EEXIST) {
+      return reportErrno(con, cachedir);
+    }
+  }
+  const AstCache* cachep = !cachedir.empty() ? &cache : nullptr;
+  build::OutputCache outcache;
+  outcache.dir = cache.dir;
+  outcache.build = cache.build;
+  const build::OutputCache* outcachep = !cachedir.empty() ? &outcache : nullptr;
+  const char* outp = outfile.empty() ? nullptr : outfile.c_str();
+
+  if (deps) {
+    if (filenames.empty()) {
+      return usage(con, prog);
     }
-    printf("write WASM code to %s\n", argv[2]);
-    if (fwrite((const void*)wbuf.data(), wbuf.size(), 1, of) == 0) {
-      err(1, "%s", argv[0]);
+    return mainDeps(con, filenames, jobs);
+  }
+  if (packages) {
+    if (filenames.empty()) {
+      return usage(con, prog);
     }
-    fclose(f); f = nullptr;
+    return mainPackages(con, strings, filenames, outp, jobs, cachep, outcachep, store,
+                        showStats);
+  }
+  if (filenames.empty() && !cwd.empty()) {
+    con.err << prog << ": no input files (stdin can not be compiled by a server)" << endl;
+    return 1;
   }
+  return mainUnits(con, strings, filenames, outp, jobs, cachep, outcachep, showStats);
+}
 
 
-  astalloc.free(prog);
-  free(srcp);
+int main(int argc, char const *argv[]) {
+  std::vector<string> args(argv, argv + argc);
+  Console con{std::cout, std::cerr};
 
-  return 0;
-}
\ No newline at end of file
+  if (argc > 1 && (args[1] == "--serve" || args[1] == "--connect")) {
+    if (argc < 3 || (args[1] == "--serve" && argc > 3)) {
+      return usage(con, args[0]);
+    }
+    const char* sockpath = argv[2];
+    string errmsg;
+    if (args[1] == "--connect") {
+      // Forward our arguments, minus "--connect SOCKET"
+      args.erase(args.begin() + 1, args.begin() + 3);
+      int status = server::forward(sockpath, args, errmsg);
+      if (status == -1) {
+        std::cerr << args[0] << ": " << errmsg << endl;
+        return 1;
+      }
+      return status;
+    }
+    // Strings and built packages are kept between commands. Strings stay in
+    // a SharedSet until it is destroyed, so once there are more than
+    // kMaxWarmStrings, the next command starts a new generation, and the
+    // old one goes away when the last command using it is done (its strings
+    // are only freed when not built with --istr-arena.)
+    struct Warm {
+      IStr::SharedSet     strings;
+      build::PackageStore packages; // holds strings of the set above
+    };
+    const size_t kMaxWarmStrings = 1 << 20;
+    std::mutex warmMu;
+    auto warm = std::make_shared<Warm>();
+    server::serve(sockpath, [&](const server::Request& req, std::ostream& out,
+                                std::ostream& err) {
+      std::shared_ptr<Warm> w;
+      {
+        std::lock_guard<std::mutex> lock(warmMu);
+        if (warm->strings.size() > kMaxWarmStrings) {
+          warm = std::make_shared<Warm>();
+        }
+        w = warm;
+      }
+      Console reqcon{out, err};
+      return run(reqcon, w->strings, &w->packages, req.args,
+                 req.cwd.empty() ? "/" : req.cwd);
+    }, errmsg);
+    std::cerr << args[0] << ": " << errmsg << endl;
+    return 1;
+  }
+
+  IStr::SharedSet strings; // string interning
+  return run(con, strings, nullptr, args, "");
+}
@@ -0,0 +1,282 @@
+#include "depscan.h"
+#include "bytescan.h"
+#include "parse.h"
+#include "strtoint.h"
+#include "text.h"
+
+namespace {
+
+enum Tok {
+  TokEnd,
+  TokIdent,
+  TokString,
+  TokOther, // any other single byte, e.g. "(" or ";"
+};
+
+struct scanner {
+  const char* src;
+  const char* p;
+  const char* end;
+  DepScan&    ds;
+  Err         err;
+
+  // Current token
+  Tok         tok = TokEnd;
+  const char* tokp = nullptr;
+  const char* tokend = nullptr;
+  std::string strval; // interpreted value of TokString
+
+  scanner(const char* src, size_t len, DepScan& ds)
+    : src{src}, p{src}, end{src + len}, ds{ds} {}
+
+  bool error(const char* msg) {
+    ds.errloc.offset = uint32_t(tokp - src);
+    ds.errloc.length = uint32_t(tokend - tokp);
+    err = Err(ParseErrSyntax, std::string(msg));
+    return false;
+  }
+
+  bool is(char c) const {
+    return tok == TokOther && *tokp == c;
+  }
+
+  template <size_t N> bool isWord(const char(&word)[N]) const {
+    return tok == TokIdent && size_t(tokend - tokp) == N - 1 &&
+           memcmp(tokp, word, N - 1) == 0;
+  }
+
+  static bool isIdentByte(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || (uint8_t)c >= 0x80;
+  }
+
+  // Skips whitespace and comments. Newlines are not significant here since
+  // the only statements are package clauses and import declarations.
+  bool skipSpace() {
+    while (p != end) {
+      switch (*p) {
+        case ' ': case '\t': case '\r': case '\n':
+          ++p;
+          break;
+        case '/': {
+          if (end - p > 1 && p[1] == '/') {
+            p = bytescan::findAny(p + 2, end, '\n');
+          } else if (end - p > 1 && p[1] == '*') {
+            const char* begin = p;
+            p += 2;
+            while (1) {
+              p = bytescan::findAny(p, end, '*');
+              if (p == end) {
+                tokp = begin;
+                tokend = begin + 2;
+                return error("unterminated general comment");
+              }
+              if (++p != end && *p == '/') {
+                ++p;
+                break;
+              }
+            }
+          } else {
+            return true;
+          }
+          break;
+        }
+        default:
+          return true;
+      }
+    }
+    return true;
+  }
+
+  bool readEscape() {
+    // See Lex readCharLitEscape
+    if (++p == end) {
+      return false;
+    }
+    int ndigits = 0;
+    switch (*p++) {
+      case 'a': strval += '\x07'; return true;
+      case 'b': strval += '\x08'; return true;
+      case 'f': strval += '\x0C'; return true;
+      case 'n': strval += '\x0A'; return true;
+      case 'r': strval += '\x0D'; return true;
+      case 't': strval += '\x09'; return true;
+      case 'v': strval += '\x0b'; return true;
+      case '"': strval += '"'; return true;
+      case '\\': strval += '\\'; return true;
+      case 'x': ndigits = 2; break;
+      case 'u': ndigits = 4; break;
+      case 'U': ndigits = 8; break;
+      default: return false;
+    }
+    UChar c;
+    if (end - p < ndigits || !strtou32(p, ndigits, 16, c)) {
+      return false;
+    }
+    p += ndigits;
+    text::appendUTF8(strval, c);
+    return true;
+  }
+
+  bool readString() {
+    // Enter after '"'
+    strval.clear();
+    while (1) {
+      const char* q = bytescan::findAny(p, end, '"', '\\', '\n');
+      strval.append(p, q - p);
+      p = q;
+      if (p == end || *p == '\n') {
+        tokend = p;
+        return error("unterminated string literal");
+      }
+      if (*p == '"') {
+        ++p;
+        return true;
+      }
+      if (!readEscape()) {
+        tokend = p;
+        return error("invalid escape sequence in import path");
+      }
+    }
+  }
+
+  bool readRawString() {
+    // Enter after '`'
+    const char* q = bytescan::findAny(p, end, '`');
+    if (q == end) {
+      tokend = end;
+      return error("unterminated raw string literal");
+    }
+    strval.clear();
+    for (; p != q; ++p) {
+      if (*p != '\r') { // ignored, like Lex does
+        strval += *p;
+      }
+    }
+    ++p;
+    return true;
+  }
+
+  // Reads the next token. Returns false on error.
+  bool next() {
+    if (!skipSpace()) {
+      return false;
+    }
+    tokp = p;
+    if (p == end) {
+      tok = TokEnd;
+    } else if (isIdentByte(*p)) {
+      while (p != end && isIdentByte(*p)) {
+        ++p;
+      }
+      tok = TokIdent;
+    } else if (*p == '"' || *p == '`') {
+      tok = TokString;
+      bool raw = *p++ == '`';
+      if (!(raw ? readRawString() : readString())) {
+        return false;
+      }
+    } else {
+      tok = TokOther;
+      ++p;
+    }
+    tokend = p;
+    return true;
+  }
+
+  SrcLoc tokLoc() const {
+    SrcLoc loc;
+    loc.offset = uint32_t(tokp - src);
+    loc.length = uint32_t(tokend - tokp);
+    return loc;
+  }
+
+  // ImportSpec = ( "." | PackageName )? ImportPath
+  bool importSpec() {
+    if (tok == TokIdent || is('.')) {
+      if (!next()) {
+        return false;
+      }
+    }
+    if (tok != TokString) {
+      return error("unexpected token; expecting import path");
+    }
+    ds.imports.push_back({strval, tokLoc()});
+    return true;
+  }
+
+  bool scan() {
+    // PackageClause = "package" PackageName
+    if (!next()) {
+      return false;
+    }
+    if (tok == TokEnd) {
+      ds.end = uint32_t(tokp - src);
+      return true; // empty file
+    }
+    if (!isWord("package")) {
+      return error("unexpected token; expecting \"package\"");
+    }
+    if (!next()) {
+      return false;
+    }
+    if (tok != TokIdent || isWord("_")) {
+      return error("unexpected token; expecting package name");
+    }
+    ds.pkgname.assign(tokp, tokend - tokp);
+    ds.pkgloc = tokLoc();
+
+    // ImportDecl = "import" ( ImportSpec | "(" { ImportSpec ";" } ")" )
+    while (1) {
+      if (!next()) {
+        return false;
+      }
+      if (is(';')) {
+        continue;
+      }
+      if (!isWord("import")) {
+        break;
+      }
+      if (!next()) {
+        return false;
+      }
+      if (!is('(')) {
+        if (!importSpec()) {
+          return false;
+        }
+        continue;
+      }
+      while (1) {
+        if (!next()) {
+          return false;
+        }
+        if (is(')')) {
+          break;
+        }
+        if (is(';')) {
+          continue;
+        }
+        if (tok == TokEnd) {
+          return error("unexpected end of input; expecting \")\"");
+        }
+        if (!importSpec()) {
+          return false;
+        }
+      }
+    }
+
+    ds.end = uint32_t(tokp - src);
+    return true;
+  }
+};
+
+} // namespace
+
+
+Err depscan(const char* src, size_t len, DepScan& ds) {
+  scanner s{src, len, ds};
+  if (!s.scan()) {
+    return std::move(s.err);
+  }
+  return Err::OK();
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "error.h"
+#include "srcloc.h"
+#include <string>
+#include <vector>
+
+// Dependency scanning.
+//
+// depscan reads only the package clause and import declarations at the top
+// of a source file and stops at the first token after them. It does not set
+// up a lexer or parser, allocate AST nodes or intern strings, and comments
+// and whitespace are skipped over with vectorized byte scans. This makes it
+// cheap enough to run on every file of a large tree before each build, to
+// find out which packages depend on each other.
+//
+// The rest of the source is not looked at, and so it is not validated
+// either; a file that scans fine might still fail to parse.
+//
+//   DepScan ds;
+//   Err err = depscan(src, srclen, ds);
+//   for (auto& imp : ds.imports) {
+//     ... imp.path ...
+//   }
+//
+struct DepScan {
+  struct Import {
+    std::string path;  // interpreted value of the path literal
+    SrcLoc      loc;   // location of the path literal
+  };
+
+  std::string         pkgname;  // empty for an empty file
+  SrcLoc              pkgloc;   // location of the package name
+  std::vector<Import> imports;  // in source order; may contain duplicates
+  uint32_t            end = 0;  // offset where scanning stopped
+  SrcLoc              errloc;   // location of an error, if any
+};
+
+// Scans the package clause and imports of len bytes of source at src.
+// Returns an error with a ParseErrCode on syntax errors, in which case
+// ds.errloc is where it happened.
+Err depscan(const char* src, size_t len, DepScan& ds);
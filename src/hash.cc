@@ -88,6 +88,16 @@ static void base64_encode_B16(const B16& id, char buf[22]) {
 }
 
 
+B16 wyhash128(const char* p, size_t len) {
+  uint64_t h[2] = { wyhash64(p, len, 0), wyhash64(p, len, WYHASH_P1) };
+  B16 r;
+  for (size_t i = 0; i != 16; ++i) {
+    r.bytes[i] = (unsigned char)(h[i >> 3] >> ((i & 7) * 8));
+  }
+  return r;
+}
+
+
 void encode_128(const B16& r, char buf[22]) {
   base64_encode_B16(r, buf);
 }
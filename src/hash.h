@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <string>
 
 namespace hash {
@@ -14,6 +15,17 @@ constexpr uint32_t fnv1a32(const char *const p, const size_t len);
 constexpr uint64_t fnv1a64(const char *const cstr);
 constexpr uint64_t fnv1a64(const char *const p, const size_t len);
 
+// Word-at-a-time hash based on wyhash. Reads 8 or 16 bytes per step, which makes it much faster
+// than FNV-1a for all but the shortest strings. Keys of up to 8 bytes are mixed with a single
+// multiply. The same implementation is used at compile time and at runtime, so constexpr and
+// runtime hashes of the same bytes are always equal. See misc/bench_hash.cc.
+constexpr uint64_t wyhash64(const char* p, size_t len, uint64_t seed=0);
+constexpr uint32_t wyhash32(const char* p, size_t len, uint64_t seed=0);
+
+// 128-bit hash of p, made from two wyhash64 lanes with different seeds. Meant for identifying
+// content, e.g. as a cache key, where 64 bits would make collisions across many files too likely.
+B16 wyhash128(const char* p, size_t len);
+
 
 // -----------------------------------------------------------------------------------------------
 // Implementations
@@ -43,4 +55,84 @@ constexpr inline uint64_t fnv1a64ext(const char* const str, const size_t len, co
 constexpr inline uint64_t fnv1a64(const char* const str, const size_t len) {
   return fnv1a64ext(str, len, FNV1A_INIT_64); }
 
+
+static const uint64_t WYHASH_P0 = 0xa0761d6478bd642full;
+static const uint64_t WYHASH_P1 = 0xe7037ed1a0b428dbull;
+
+// Little-endian loads assembled from bytes so that they can be evaluated at compile time.
+// Compilers recognize the pattern and emit a single load instruction.
+constexpr inline uint64_t wyr8(const char* p) {
+  return  uint64_t(uint8_t(p[0]))        | (uint64_t(uint8_t(p[1])) << 8)  |
+         (uint64_t(uint8_t(p[2])) << 16) | (uint64_t(uint8_t(p[3])) << 24) |
+         (uint64_t(uint8_t(p[4])) << 32) | (uint64_t(uint8_t(p[5])) << 40) |
+         (uint64_t(uint8_t(p[6])) << 48) | (uint64_t(uint8_t(p[7])) << 56);
+}
+constexpr inline uint64_t wyr4(const char* p) {
+  return  uint64_t(uint8_t(p[0]))        | (uint64_t(uint8_t(p[1])) << 8)  |
+         (uint64_t(uint8_t(p[2])) << 16) | (uint64_t(uint8_t(p[3])) << 24);
+}
+constexpr inline uint64_t wyr3(const char* p, size_t k) { // 1 <= k <= 3
+  return (uint64_t(uint8_t(p[0])) << 16) | (uint64_t(uint8_t(p[k >> 1])) << 8) |
+          uint64_t(uint8_t(p[k - 1]));
+}
+
+// 64x64 -> 128 bit multiply. Stores the low half of the result in a and the high half in b.
+constexpr inline void wymum(uint64_t& a, uint64_t& b) {
+  #if defined(__SIZEOF_INT128__)
+  __uint128_t r = __uint128_t(a) * b;
+  a = uint64_t(r);
+  b = uint64_t(r >> 64);
+  #else
+  uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  a = lo;
+  b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  #endif
+}
+
+constexpr inline uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(a, b);
+  return a ^ b;
+}
+
+constexpr inline uint64_t wyhash64(const char* p, size_t len, uint64_t seed) {
+  seed ^= wymix(seed ^ WYHASH_P0, WYHASH_P1);
+  uint64_t a = 0, b = 0;
+  if (len <= 8) {
+    // Short keys, i.e. most identifiers, fit in one word which is mixed once
+    if (len >= 4) {
+      a = (wyr4(p) << 32) | wyr4(p + len - 4);
+    } else if (len > 0) {
+      a = wyr3(p, len);
+    }
+    return wymix(a ^ WYHASH_P1, seed ^ WYHASH_P0 ^ uint64_t(len));
+  }
+  if (len <= 16) {
+    // 9 to 16 bytes
+    size_t d = (len >> 3) << 2;
+    a = (wyr4(p) << 32) | wyr4(p + d);
+    b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - d);
+  } else {
+    size_t i = len;
+    for (; i > 16; i -= 16, p += 16) {
+      seed = wymix(wyr8(p) ^ WYHASH_P1, wyr8(p + 8) ^ seed);
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+  a ^= WYHASH_P1;
+  b ^= seed;
+  wymum(a, b);
+  return wymix(a ^ WYHASH_P0 ^ uint64_t(len), b ^ WYHASH_P1);
+}
+
+constexpr inline uint32_t wyhash32(const char* p, size_t len, uint64_t seed) {
+  uint64_t h = wyhash64(p, len, seed);
+  return uint32_t(h ^ (h >> 32));
+}
+
 } // namespace
@@ -1,12 +1,53 @@
 #include "istr.h"
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
 
 const char* kIStrEmptyCStr = "";
 
+#if RX_ISTR_ARENA
+
+// Each thread bump-allocates from its own block so that no locking is needed. Blocks are never
+// freed. Strings too large to fit well in a block get an allocation of their own.
+static constexpr size_t kIStrArenaBlockSize = 64 * 1024;
+
+static thread_local char* tArenaPos = nullptr;
+static thread_local char* tArenaEnd = nullptr;
+
+static void* arena_alloc(size_t size) {
+  size = (size + 7) & ~size_t(7);
+  if (size > kIStrArenaBlockSize / 4) {
+    return malloc(size);
+  }
+  if (size_t(tArenaEnd - tArenaPos) < size) {
+    char* block = (char*)malloc(kIStrArenaBlockSize);
+    if (!block) {
+      return nullptr;
+    }
+    tArenaPos = block;
+    tArenaEnd = block + kIStrArenaBlockSize;
+  }
+  void* p = tArenaPos;
+  tArenaPos += size;
+  return p;
+}
+
+#endif // RX_ISTR_ARENA
+
+
 IStr::Imp* IStr::Imp::create(const char* s, uint32_t length, uint32_t hash) {
   uint32_t cstr_size = length+1;
+  #if RX_ISTR_ARENA
+  Imp* self = (Imp*)arena_alloc(sizeof(Imp) + cstr_size);
+  #else
   Imp* self = (Imp*)malloc(sizeof(Imp) + cstr_size);
+  #endif
   if (self) {
-    self->__refc = 1;
     self->_hash = hash;
     self->_size = length;
     memcpy((void*)&self->_cstr, (const void*)s, cstr_size);
@@ -15,65 +56,271 @@ IStr::Imp* IStr::Imp::create(const char* s, uint32_t length, uint32_t hash) {
       // cstr_size==1 means that the string is empty. Since we rely on some really funky hacks
       // where we check _cstr[0] for NUL, and fall back on _p.ps, we need to set _p.ps to a
       // constant C-string (the empty string).
+    #if RX_ISTR_ARENA
+    // Arena strings are constant just like Const strings: not reference counted and never bound
+    // to a WeakRef, since they are never deallocated.
+    self->__refc = RX_REF_COUNT_CONSTANT;
+    if (cstr_size != 1) {
+      self->_p.weak_self = (WeakRef*)kIStrConstPMagic;
+    }
+    #else
+    self->__refc = 1;
+    #endif
   }
   return self;
 }
 
 
+// ------------------------------------------------------------------------------------------------
+
+namespace {
+
+// Returns a bitmask of the bytes in the group at ctrl that are equal to b
+inline uint32_t matchGroup(const uint8_t* ctrl, uint8_t b) {
+  #if defined(__SSE2__)
+  __m128i v = _mm_load_si128((const __m128i*)ctrl);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)b)));
+  #else
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i != 16; ++i) {
+    mask |= uint32_t(ctrl[i] == b) << i;
+  }
+  return mask;
+  #endif
+}
+
+inline uint8_t ctrlTag(uint32_t hash) { return hash & 0x7f; }
+inline size_t groupIndex(uint32_t hash, size_t ngroups) { return (hash >> 7) & (ngroups - 1); }
+
+inline bool slotEquals(const IStr::Imp* p, const char* s, uint32_t len) {
+  return p->_size == len && memcmp(p->c_str(), s, len) == 0;
+}
+
+} // namespace
+
+
+template <typename Slot>
+IStrTable<Slot>::IStrTable(size_t minCapacity) {
+  size_t cap = kGroupSize;
+  while (cap < minCapacity) {
+    cap <<= 1;
+  }
+  rehash(cap);
+}
+
+
+template <typename Slot>
+IStrTable<Slot>::~IStrTable() {
+  for (size_t i = 0; i != _cap; ++i) {
+    _slots[i].~Slot();
+  }
+  free(_slots);
+  free(_ctrl);
+}
+
+
+template <typename Slot>
+Slot* IStrTable<Slot>::find(const char* s, uint32_t len, uint32_t hash) const {
+  // Groups are visited in triangular order which covers all groups since the
+  // number of groups is a power of two.
+  size_t ngroups = _cap / kGroupSize;
+  size_t g = groupIndex(hash, ngroups);
+  uint8_t tag = ctrlTag(hash);
+  for (size_t step = 1; ; ++step) {
+    const uint8_t* ctrl = &_ctrl[g * kGroupSize];
+    Slot* slots = &_slots[g * kGroupSize];
+    for (uint32_t m = matchGroup(ctrl, tag); m != 0; m &= m - 1) {
+      Slot& slot = slots[__builtin_ctz(m)];
+      auto p = slot.imp();
+      if (slot.hash == hash && p && slotEquals(p, s, len)) {
+        return &slot;
+      }
+    }
+    if (matchGroup(ctrl, kEmpty) != 0 || step == ngroups) {
+      return nullptr;
+    }
+    g = (g + step) & (ngroups - 1);
+  }
+}
+
+
+template <typename Slot>
+Slot* IStrTable<Slot>::insert(const char* s, uint32_t len, uint32_t hash, bool& found) {
+  if ((_used + 1) * 8 > _cap * 7) {
+    // Over 7/8 full. Rehashing drops dead slots, so only grow if there's a
+    // significant number of live ones.
+    size_t live = 0;
+    for (size_t i = 0; i != _cap; ++i) {
+      live += (_ctrl[i] != kEmpty && _slots[i].imp() != nullptr);
+    }
+    rehash(live * 2 >= _cap ? _cap * 2 : _cap);
+  }
+
+  size_t ngroups = _cap / kGroupSize;
+  size_t g = groupIndex(hash, ngroups);
+  uint8_t tag = ctrlTag(hash);
+  Slot* reuse = nullptr; // first dead slot seen
+  size_t reuseIndex = 0;
+
+  for (size_t step = 1; ; ++step) {
+    uint8_t* ctrl = &_ctrl[g * kGroupSize];
+    Slot* slots = &_slots[g * kGroupSize];
+    for (uint32_t m = matchGroup(ctrl, tag); m != 0; m &= m - 1) {
+      Slot& slot = slots[__builtin_ctz(m)];
+      auto p = slot.imp();
+      if (slot.hash == hash && p && slotEquals(p, s, len)) {
+        found = true;
+        return &slot;
+      }
+    }
+    if (reuse == nullptr) {
+      for (uint32_t i = 0; i != kGroupSize; ++i) {
+        if (ctrl[i] != kEmpty && slots[i].imp() == nullptr) {
+          reuse = &slots[i];
+          reuseIndex = g * kGroupSize + i;
+          break;
+        }
+      }
+    }
+    uint32_t empty = matchGroup(ctrl, kEmpty);
+    if (empty != 0 || step == ngroups) {
+      found = false;
+      if (reuse != nullptr) {
+        _ctrl[reuseIndex] = tag;
+        reuse->hash = hash;
+        return reuse;
+      }
+      assert(empty != 0); // the table is never full
+      uint32_t i = __builtin_ctz(empty);
+      ctrl[i] = tag;
+      slots[i].hash = hash;
+      ++_used;
+      return &slots[i];
+    }
+    g = (g + step) & (ngroups - 1);
+  }
+}
+
+
+template <typename Slot>
+void IStrTable<Slot>::rehash(size_t cap) {
+  uint8_t* oldCtrl = _ctrl;
+  Slot* oldSlots = _slots;
+  size_t oldCap = _cap;
+
+  // Control bytes are loaded 16 at a time and so must be 16-byte aligned.
+  // A zeroed Slot is a valid empty slot.
+  _ctrl = (uint8_t*)aligned_alloc(kGroupSize, cap);
+  memset(_ctrl, kEmpty, cap);
+  _slots = (Slot*)calloc(cap, sizeof(Slot));
+  _cap = cap;
+  _used = 0;
+
+  for (size_t i = 0; i != oldCap; ++i) {
+    Slot& slot = oldSlots[i];
+    auto p = slot.imp();
+    if (oldCtrl[i] != kEmpty && p != nullptr) {
+      bool found;
+      Slot* dst = insert(p->c_str(), p->_size, slot.hash, found);
+      assert(!found);
+      slot.moveTo(*dst);
+    }
+    slot.~Slot();
+  }
+  free(oldSlots);
+  free(oldCtrl);
+}
+
+
+template struct IStrTable<IStr::Set::Slot>;
+template struct IStrTable<IStr::WeakSet::Slot>;
+
 // ------------------------------------------------------------------------------------------------
 
 #define ISTRSET_TMPWRAP \
   assert(s); \
   if (len == 0xffffffffu) len = strlen(s); \
-  auto sw = ConstIStr(s, len); \
-  IStr::Imp* obj = (IStr::Imp*)&sw;
+  uint32_t hash = IStr::hash(s, len);
+
+
+IStr::Set::Set(std::initializer_list<IStr::Imp*> items, size_t min_buckets)
+  : _table{min_buckets}
+{
+  for (auto p : items) {
+    bool found;
+    auto slot = _table.insert(p->c_str(), p->_size, p->_hash, found);
+    if (!found) {
+      IStr::__retain(p);
+      slot->p = p;
+    }
+  }
+}
 
 
 IStr IStr::Set::get(const char* s, uint32_t len) {
   // Return or create a IStr object representing the byte array of `len` at `s`
   ISTRSET_TMPWRAP
+  return get(s, len, hash);
+}
 
-  auto P = _set.emplace(obj);
-  if (P.second) {
-    // Did insert. Update inserted pointer with the address of a new IStr::Imp
-    obj = IStr::Imp::create(s, len, sw._hash);
-    IStr::Imp** vp = const_cast<IStr::Imp**>(&*P.first); // IStr::Imp*const*
-    *vp = obj;
-  } else {
-    // Already exists
-    obj = *P.first;
-  }
 
-  return IStr{obj};
+IStr IStr::Set::get(const char* s, uint32_t len, uint32_t hash) {
+  assert(hash == IStr::hash(s, len));
+  bool found;
+  auto slot = _table.insert(s, len, hash, found);
+  if (!found) {
+    slot->p = IStr::Imp::create(s, len, hash);
+  }
+  return IStr{slot->p};
 }
 
 
 IStr IStr::Set::find(const char* s, uint32_t len) {
   ISTRSET_TMPWRAP
-  auto I = _set.find(obj);
-  return I == _set.end() ? nullptr : IStr{*I};
+  auto slot = _table.find(s, len, hash);
+  return slot == nullptr ? nullptr : IStr{slot->p};
+}
+
+
+IStr::WeakSet::WeakSet(std::initializer_list<WeakRef> items, size_t min_buckets)
+  : _table{min_buckets}
+{
+  for (auto& ref : items) {
+    auto p = ref.self;
+    if (p) {
+      bool found;
+      auto slot = _table.insert(p->c_str(), p->_size, p->_hash, found);
+      if (!found) {
+        slot->ref.self = p;
+        slot->ref._bind();
+      }
+    }
+  }
 }
 
 
 IStr IStr::WeakSet::get(const char* s, uint32_t len) {
   // Return or create a IStr object representing the byte array of `len` at `s`
   ISTRSET_TMPWRAP
-    // Here we wrap `s` so that we can look it up without copying the string. In the case that `s`
-    // is already represented in the set, the whole operation is cheap in the sense that no copies
-    // are created to deallocated.
-
-  auto P = _set.emplace(obj);
-  if (P.second || !P.first->self) {
-    // Did insert. Update inserted pointer with the address of a new IStr::Imp
-    // printf("intern MISS (%s) '%s'\n", (!P.first->self ? "reuse-slot" : "new-slot"), s);
-    obj = IStr::Imp::create(s, len, sw._hash);
-    WeakRef* ws = ((WeakRef*)(&*P.first));
-    ws->self = obj;
-    ws->_bind();
+  return get(s, len, hash);
+}
+
+
+IStr IStr::WeakSet::get(const char* s, uint32_t len, uint32_t hash) {
+  assert(hash == IStr::hash(s, len));
+    // Here we look up `s` without copying the string. In the case that `s` is already represented
+    // in the set, the whole operation is cheap in the sense that no copies are created.
+
+  bool found;
+  auto slot = _table.insert(s, len, hash, found);
+  IStr::Imp* obj;
+  if (!found) {
+    // Empty or dead slot. Store the address of a new IStr::Imp
+    obj = IStr::Imp::create(s, len, hash);
+    slot->ref.self = obj;
+    slot->ref._bind();
   } else {
-    // Does exist
-    // printf("intern HIT '%s'\n", s);
-    obj = P.first->self;
+    obj = slot->ref.self;
     IStr::__retain(obj);
   }
 
@@ -83,8 +330,168 @@ IStr IStr::WeakSet::get(const char* s, uint32_t len) {
 
 IStr IStr::WeakSet::find(const char* s, uint32_t len) {
   ISTRSET_TMPWRAP
-  auto I = _set.find(obj);
-  return I == _set.end() ? nullptr : IStr{I->self};
+  auto slot = _table.find(s, len, hash);
+  return slot == nullptr ? nullptr : IStr{slot->ref.self};
+}
+
+
+
+// ------------------------------------------------------------------------------------------------
+
+// Shards are linear-probing tables of atomic string pointers. Readers load the current table and
+// probe it without locking. Writers lock the shard and store new strings with release semantics,
+// so that a reader which observes a pointer also observes the string it points to. When a table
+// grows, the entries are copied to a new table which is then published. The old table may still
+// be in use by readers, so it's kept around until the set is destroyed. Since tables at least
+// double in size, retired tables take up less memory than the current one.
+
+namespace {
+
+struct SharedTable {
+  size_t                           mask; // capacity - 1
+  std::atomic<IStr::Imp*>          slots[1];
+
+  static SharedTable* create(size_t capacity) {
+    auto t = (SharedTable*)calloc(1, sizeof(SharedTable) + sizeof(slots[0]) * (capacity - 1));
+    t->mask = capacity - 1;
+    for (size_t i = 0; i != capacity; ++i) {
+      new (&t->slots[i]) std::atomic<IStr::Imp*>(nullptr);
+    }
+    return t;
+  }
+
+  // Returns the index of the slot which holds `s`, or the empty slot where it would be inserted
+  size_t probe(const char* s, uint32_t len, uint32_t hash, IStr::Imp*& p) const {
+    size_t i = hash & mask;
+    while (1) {
+      p = slots[i].load(std::memory_order_acquire);
+      if (p == nullptr || (p->_hash == hash && slotEquals(p, s, len))) {
+        return i;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+};
+
+} // namespace
+
+
+// Aligned to cache lines so that shards don't contend with each other
+struct alignas(64) IStr::SharedSet::Shard {
+  std::atomic<SharedTable*>  table{nullptr};
+  std::mutex                 mu;      // held by writers
+  size_t                     count = 0;
+  std::vector<SharedTable*>  retired; // old tables, possibly still being read
+};
+
+
+IStr::SharedSet::SharedSet(size_t min_buckets) {
+  // operator new[] does not honor the alignment of Shard before C++17
+  void* mem = nullptr;
+  if (posix_memalign(&mem, alignof(Shard), sizeof(Shard) * kShardCount) != 0) {
+    throw std::bad_alloc();
+  }
+  _shards = (Shard*)mem;
+  for (uint32_t i = 0; i != kShardCount; ++i) {
+    new (&_shards[i]) Shard;
+  }
+  size_t cap = 16;
+  while (cap < min_buckets) {
+    cap <<= 1;
+  }
+  for (uint32_t i = 0; i != kShardCount; ++i) {
+    _shards[i].table.store(SharedTable::create(cap), std::memory_order_relaxed);
+  }
+}
+
+
+IStr::SharedSet::~SharedSet() {
+  for (uint32_t i = 0; i != kShardCount; ++i) {
+    Shard& shard = _shards[i];
+    SharedTable* t = shard.table.load(std::memory_order_relaxed);
+    for (size_t j = 0; j <= t->mask; ++j) {
+      IStr::__release(t->slots[j].load(std::memory_order_relaxed));
+    }
+    free(t);
+    for (auto rt : shard.retired) {
+      free(rt);
+    }
+    shard.~Shard();
+  }
+  free(_shards);
+}
+
+
+// The shard is selected by the top bits of the hash while the slot within a shard's table is
+// selected by the low bits, so that the two are independent.
+#define SHAREDSET_SHARD(hash) _shards[(hash) >> (32 - kShardBits)]
+
+
+IStr IStr::SharedSet::get(const char* s, uint32_t len) {
+  // Return or create a IStr object representing the byte array of `len` at `s`
+  ISTRSET_TMPWRAP
+  return get(s, len, hash);
+}
+
+
+IStr IStr::SharedSet::get(const char* s, uint32_t len, uint32_t hash) {
+  assert(hash == IStr::hash(s, len));
+  Shard& shard = SHAREDSET_SHARD(hash);
+  IStr::Imp* p;
+
+  // Common case: the string is already in the set
+  shard.table.load(std::memory_order_acquire)->probe(s, len, hash, p);
+  if (p) {
+    return IStr{p};
+  }
+
+  std::lock_guard<std::mutex> lock(shard.mu);
+
+  // Another thread might have inserted the string or grown the table since we looked
+  SharedTable* t = shard.table.load(std::memory_order_relaxed);
+  size_t i = t->probe(s, len, hash, p);
+  if (p) {
+    return IStr{p};
+  }
+
+  p = IStr::Imp::create(s, len, hash); // +1 reference owned by the set
+  t->slots[i].store(p, std::memory_order_release);
+
+  if (++shard.count * 4 > (t->mask + 1) * 3) {
+    // Over 3/4 full. Copy to a table twice the size and publish it.
+    SharedTable* t2 = SharedTable::create((t->mask + 1) * 2);
+    for (size_t j = 0; j <= t->mask; ++j) {
+      IStr::Imp* p2 = t->slots[j].load(std::memory_order_relaxed);
+      if (p2) {
+        IStr::Imp* existing;
+        size_t k = t2->probe(p2->c_str(), p2->_size, p2->_hash, existing);
+        t2->slots[k].store(p2, std::memory_order_relaxed);
+      }
+    }
+    shard.table.store(t2, std::memory_order_release);
+    shard.retired.push_back(t);
+  }
+
+  return IStr{p};
+}
+
+
+IStr IStr::SharedSet::find(const char* s, uint32_t len) const {
+  ISTRSET_TMPWRAP
+  IStr::Imp* p;
+  SHAREDSET_SHARD(hash).table.load(std::memory_order_acquire)->probe(s, len, hash, p);
+  return IStr{p};
+}
+
+
+size_t IStr::SharedSet::size() const {
+  size_t n = 0;
+  for (uint32_t i = 0; i != kShardCount; ++i) {
+    std::lock_guard<std::mutex> lock(_shards[i].mu);
+    n += _shards[i].count;
+  }
+  return n;
 }
 
+#undef SHAREDSET_SHARD
 #undef ISTRSET_TMPWRAP
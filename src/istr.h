@@ -1,5 +1,5 @@
 //
-// Small single-allocation byte string with precomputed fnv1a hash.
+// Small single-allocation byte string with precomputed hash.
 // It comes with in two bridge-free implementations:
 //  - Runtime-dynamic, heap allocated, reference counted.
 //  - Constexpr, stack allocated.
@@ -42,12 +42,24 @@
 #include "hash.h"
 #include <assert.h>
 #include <ostream>
-#include <unordered_set>
 #include <unordered_map>
+#include <initializer_list>
 #include <string>
 
+// When RX_ISTR_ARENA is 1, dynamic strings are bump-allocated from large blocks and are never
+// freed, and retain and release are no-ops. Meant for short-lived processes like a one-shot
+// compile where all strings are interned and live until exit anyway.
+#ifndef RX_ISTR_ARENA
+  #define RX_ISTR_ARENA 0
+#endif
+
 
-struct IStr { RX_REF_MIXIN_NOVTABLE(IStr)
+struct IStr {
+  #if RX_ISTR_ARENA
+  RX_REF_MIXIN_NOVTABLE_IMMORTAL(IStr)
+  #else
+  RX_REF_MIXIN_NOVTABLE(IStr)
+  #endif
   template <size_t N> struct Const; struct Wrap;
 
   IStr() : self{0} {}; // == false == nullptr
@@ -86,12 +98,21 @@ struct IStr { RX_REF_MIXIN_NOVTABLE(IStr)
     // As long as a string is in use, it will remain in the set. But when the string is deallocated,
     // the slot in the set used to hold that string will be invalidated, and marked for reuse.
 
+  struct SharedSet;
+    // Container that holds strong references to unique strings and can be used concurrently
+    // from any number of threads.
+
   template<typename V> using Map =
     typename std::unordered_map<IStr, V, IStr::Hash, IStr::Equal>;
     // Uniquely maps strings to values of type `V`
 
-  constexpr static uint32_t hash(const char* cstr) { return hash::fnv1a32(cstr); }
-  constexpr static uint32_t hash(const char* p, size_t len) { return hash::fnv1a32(p, len); }
+  constexpr static uint32_t hash(const char* p, size_t len) { return hash::wyhash32(p, len); }
+  constexpr static uint32_t hash(const char* cstr) { return hash(cstr, cstr_len(cstr)); }
+  constexpr static size_t cstr_len(const char* cstr) {
+    size_t n = 0;
+    while (cstr[n]) { ++n; }
+    return n;
+  }
 
   template <size_t N> static constexpr Imp* imp_cast(const Const<N>& cs) {
     return (Imp*)static_cast<const Const<N>*>(&cs); }
@@ -333,6 +354,9 @@ inline void IStr::__dealloc(Imp* self) {
   //        ,(self->_p.ps == kIStrEmptyCStr ? "true" : "false")
   //        ,self->c_str()
   //        ,self->c_str()[0] );
+  #if RX_ISTR_ARENA
+  assert(!"arena strings are never deallocated");
+  #endif
   if (self->_p.ps != kIStrEmptyCStr && self->_p.weak_self) {
     self->_p.weak_self->invalidate();
   }
@@ -395,12 +419,54 @@ inline static std::ostream& operator<< (std::ostream& os, const IStr::Const<N>&
 
 // -----------------------------------------------------------------------------------------------
 
+// Open-addressing hash table of strings, used by IStr::Set and IStr::WeakSet.
+//
+// Each slot stores the string's precomputed hash next to its pointer. Slots are
+// probed in groups of 16, and each slot has a control byte: either kEmpty or
+// the low 7 bits of the slot's hash. A whole group can then be matched against
+// a hash with a single SIMD compare, and most non-matching slots are rejected
+// without touching slot memory.
+//
+// Strings are never removed from the table. Instead, a WeakSet slot whose
+// string has been deallocated (its WeakRef invalidated) acts as a tombstone
+// and is reused by the next insertion that probes past it.
+//
+// Slot must provide `IStr::Imp* imp() const` (null for a dead slot) and
+// `void moveTo(Slot&)`, used when the table is resized.
+template <typename Slot> struct IStrTable {
+  static constexpr uint8_t kEmpty = 0x80;
+  static constexpr size_t  kGroupSize = 16;
+
+  IStrTable(size_t minCapacity);
+  ~IStrTable();
+
+  Slot* find(const char* s, uint32_t len, uint32_t hash) const;
+    // Returns the slot holding string `s`, or null if there's no such slot.
+
+  Slot* insert(const char* s, uint32_t len, uint32_t hash, bool& found);
+    // Returns the slot for string `s`. If `s` is not in the table, a free or dead slot is claimed
+    // for it, `found` is set to false and the caller is responsible for storing a string in the
+    // slot.
+
+  size_t size() const { return _used; }
+    // Number of slots in use, including dead ones.
+
+private:
+  IStrTable(const IStrTable&) = delete;
+  void rehash(size_t capacity);
+
+  uint8_t* _ctrl = nullptr;
+  Slot*    _slots = nullptr;
+  size_t   _cap = 0;  // number of slots, a power of two and a multiple of kGroupSize
+  size_t   _used = 0; // number of slots not empty
+};
+
+
 struct IStr::Set {
   // Container that holds strong references to unique strings and provides efficient C-string
   // lookup and insertion.
 
-  Set(std::initializer_list<IStr::Imp*> items, size_t min_buckets=8)
-    : _set{items, min_buckets} {}
+  Set(std::initializer_list<IStr::Imp*> items, size_t min_buckets=8);
     // Initialize the set with `items`. Use a minimum of `min_buckets` for hashing.
 
   template <typename... Args> Set(Args... items)
@@ -411,13 +477,23 @@ struct IStr::Set {
   IStr get(const std::string& s) { return get(s.data(), s.size()); }
     // Return a IStr representing the byte array `s` of `len` size, with a +1 reference count.
 
+  IStr get(const char* s, uint32_t len, uint32_t hash);
+    // Like get(s, len) but with a precomputed `hash`, which must be equal to IStr::hash(s, len).
+
   IStr find(const char* s, uint32_t len=0xffffffffu);
   IStr find(const std::string& s) { return find(s.data(), s.size()); }
     // Return a IStr if the set contains `s` of `len`. Otherwise a null IStr is returned.
 
+  struct Slot {
+    uint32_t   hash;
+    IStr::Imp* p;
+    IStr::Imp* imp() const { return p; }
+    void moveTo(Slot& dst) { dst.hash = hash; dst.p = p; p = nullptr; }
+    ~Slot() { IStr::__release(p); }
+  };
+
 protected:
-  typedef std::unordered_set<IStr::Imp*, IStr::Hash, IStr::Equal> set_type;
-  set_type _set;
+  IStrTable<Slot> _table;
 };
 
 
@@ -427,8 +503,7 @@ struct IStr::WeakSet {
   // As long as a string is in use, it will remain in the set. But when the string is deallocated,
   // the slot in the set used to hold that string will be invalidated, and marked for reuse.
 
-  WeakSet(std::initializer_list<WeakRef> items, size_t min_buckets=8)
-    : _set{items, min_buckets} {}
+  WeakSet(std::initializer_list<WeakRef> items, size_t min_buckets=8);
     // Initialize the set with `items`. Use a minimum of `min_buckets` for hashing.
 
   template <typename... Args> WeakSet(Args... items)
@@ -439,13 +514,67 @@ struct IStr::WeakSet {
   IStr get(const std::string& s) { return get(s.data(), s.size()); }
     // Return a IStr representing the byte array `s` of `len` size, with a +1 reference count.
 
+  IStr get(const char* s, uint32_t len, uint32_t hash);
+    // Like get(s, len) but with a precomputed `hash`, which must be equal to IStr::hash(s, len).
+
   IStr find(const char* s, uint32_t len=0xffffffffu);
   IStr find(const std::string& s) { return find(s.data(), s.size()); }
     // Return a IStr if the set contains `s` of `len`. Otherwise a null IStr is returned.
 
+  struct Slot {
+    uint32_t hash;
+    WeakRef  ref; // WeakRef keeps the string's `weak_self` pointing at this slot
+    IStr::Imp* imp() const { return ref.self; }
+    void moveTo(Slot& dst) {
+      dst.hash = hash;
+      dst.ref.self = ref.self;
+      ref.self = 0;
+      if (dst.ref.self) {
+        dst.ref._bind(); // rebind the string to its new slot
+      }
+    }
+  };
+
 protected:
-  typedef std::unordered_set<WeakRef, WeakRef::Hash, WeakRef::EqualNullTrue> set_type;
-  set_type _set;
+  IStrTable<Slot> _table;
+};
+
+
+struct IStr::SharedSet {
+  // Container that holds strong references to unique strings and provides C-string lookup and
+  // insertion that is safe to use from any number of threads at once. Equal strings intern to the
+  // same object no matter which thread interned them, so they can be compared by pointer.
+  //
+  // The set is split into kShardCount shards selected by the top bits of a string's hash. Lookups
+  // of strings that are already in the set take no locks. Inserting a new string locks only the
+  // shard it belongs to. Strings stay in the set until the set is destroyed.
+
+  static constexpr uint32_t kShardBits = 6;
+  static constexpr uint32_t kShardCount = 1u << kShardBits;
+
+  SharedSet(size_t min_buckets=8);
+  ~SharedSet();
+    // Initialize the set with a minimum of `min_buckets` per shard.
+
+  IStr get(const char* s, uint32_t len=0xffffffffu);
+  IStr get(const std::string& s) { return get(s.data(), s.size()); }
+    // Return a IStr representing the byte array `s` of `len` size, with a +1 reference count.
+
+  IStr get(const char* s, uint32_t len, uint32_t hash);
+    // Like get(s, len) but with a precomputed `hash`, which must be equal to IStr::hash(s, len).
+
+  IStr find(const char* s, uint32_t len=0xffffffffu) const;
+  IStr find(const std::string& s) const { return find(s.data(), s.size()); }
+    // Return a IStr if the set contains `s` of `len`. Otherwise a null IStr is returned.
+
+  size_t size() const;
+    // Number of strings in the set. Only exact when no other thread is inserting.
+
+  struct Shard;
+
+private:
+  SharedSet(const SharedSet&) = delete;
+  Shard* _shards; // kShardCount shards
 };
 
 #undef ISTR_TRACE
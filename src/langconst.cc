@@ -5,14 +5,5 @@ LANG_CONST_ALL
 #undef S
 
 bool lang_isKeyword(const IStr& s) {
-  // Let's rely on a switch until we have our first collision,
-  // in which case the compiler will tell us.
-  switch (s.hash()) {
-    #define S(name) case kLang_##name.hash():
-    LANG_CONST_KEYWORDS
-    #undef S
-      return true;
-    default:
-      return false;
-  }
+  return s && lang_keywordIndex(s.c_str(), s.size(), s.hash()) != -1;
 }
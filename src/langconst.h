@@ -1,9 +1,12 @@
 #pragma once
 #include "istr.h"
 
+// Keywords. Each keyword has a corresponding Lex::Kw_* token.
 #define LANG_CONST_KEYWORDS \
   S(type) S(func) \
   S(true) S(false) \
+  S(const) S(struct) \
+  S(package) S(import) \
 /**/
 #define LANG_CONST_INTRINSIC_TYPENAMES \
   S(bool) \
@@ -33,3 +36,64 @@ static constexpr size_t langconst_strlen_cx(char const* c) {
     IStr::hash(#name, langconst_strlen_cx(#name));
 LANG_CONST_ALL
 #undef S
+
+
+// Keyword lookup by perfect hash.
+//
+// Keywords are mapped to slots of a small table by multiplying their IStr::hash with a seed and
+// taking the top bits. The seed is found at compile time by trying odd multipliers until one maps
+// every keyword to a slot of its own. Looking up a string that has already been hashed is then a
+// multiply, a table load and a single compare.
+static constexpr uint32_t kLangKeywordSlotBits = 4;
+
+#define S(name) #name,
+static constexpr const char* kLangKeywords[] = { LANG_CONST_KEYWORDS };
+#undef S
+#define S(name) kLang_##name##_hash,
+static constexpr uint32_t kLangKeywordHashes[] = { LANG_CONST_KEYWORDS };
+#undef S
+#define S(name) uint8_t(langconst_strlen_cx(#name)),
+static constexpr uint8_t kLangKeywordLengths[] = { LANG_CONST_KEYWORDS };
+#undef S
+static constexpr uint32_t kLangKeywordCount = sizeof(kLangKeywordHashes) / sizeof(uint32_t);
+
+struct LangKeywordTable {
+  uint32_t seed;
+  uint8_t  slots[1u << kLangKeywordSlotBits]; // index into kLangKeywords + 1, or 0 if empty
+
+  static constexpr uint32_t slot(uint32_t hash, uint32_t seed) {
+    return (hash * seed) >> (32 - kLangKeywordSlotBits);
+  }
+};
+
+static constexpr LangKeywordTable lang_makeKeywordTable() {
+  for (uint32_t seed = 1; seed < 0x100000; seed += 2) {
+    LangKeywordTable t{seed, {}};
+    uint32_t i = 0;
+    for (; i != kLangKeywordCount; ++i) {
+      uint32_t slot = LangKeywordTable::slot(kLangKeywordHashes[i], seed);
+      if (t.slots[slot] != 0) {
+        break; // collision
+      }
+      t.slots[slot] = uint8_t(i + 1);
+    }
+    if (i == kLangKeywordCount) {
+      return t;
+    }
+  }
+  return LangKeywordTable{0, {}};
+}
+
+static constexpr LangKeywordTable kLangKeywordTable = lang_makeKeywordTable();
+static_assert(kLangKeywordTable.seed != 0, "no perfect hash for LANG_CONST_KEYWORDS");
+
+// Returns the index in LANG_CONST_KEYWORDS of the keyword `p` of `len` bytes with IStr::hash
+// `hash`, or -1 if it's not a keyword.
+inline int lang_keywordIndex(const char* p, size_t len, uint32_t hash) {
+  uint32_t i = kLangKeywordTable.slots[LangKeywordTable::slot(hash, kLangKeywordTable.seed)];
+  if (i != 0 && kLangKeywordHashes[i - 1] == hash && kLangKeywordLengths[i - 1] == len &&
+      memcmp(kLangKeywords[i - 1], p, len) == 0) {
+    return int(i - 1);
+  }
+  return -1;
+}
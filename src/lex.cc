@@ -1,8 +1,9 @@
 #include "lex.h"
 #include "strtoint.h"
+#include "bytescan.h"
+#include "langconst.h"
 #include <iostream>
-#include <stack>
-#include <deque>
+#include <vector>
 #include <assert.h>
 
 // When defined, unicode codepoints are validated:
@@ -14,6 +15,14 @@
   #define fallthrough (void(0))
 #endif
 
+// Maps LANG_CONST_KEYWORDS indices to tokens
+#define S(name) Lex::Kw_##name,
+static constexpr Lex::Token kKeywordTokens[] = { LANG_CONST_KEYWORDS };
+#undef S
+static_assert(sizeof(kKeywordTokens) / sizeof(Lex::Token) ==
+              Lex::EndKeyword - Lex::BeginKeyword - 1,
+              "Lex::Kw_* tokens out of sync with LANG_CONST_KEYWORDS");
+
 using std::string;
 using std::cerr;
 using std::endl;
@@ -48,48 +57,128 @@ using std::endl;
 
 #define XXXXXSUBLIMETEXTWTFS
 
+// Byte classes for the ASCII fast path of Lex::Imp. Bytes below 0x80 are
+// classified without going through the UTF-8 decoder or text::category.
+enum ByteClass : uint8_t {
+  BcOther = 0, // handled by the switch in Lex::Imp::next (operators, LF, etc)
+  BcSym,       // may start or continue an identifier
+  BcSpace,     // space and tab; ignored between tokens
+  BcUTF8,      // part of a multibyte UTF-8 sequence
+};
+
+#define O BcOther
+#define S BcSym
+#define W BcSpace
+#define U BcUTF8
+static const uint8_t kByteClass[256] = {
+  //0 1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+  O, O, O, O, O, O, O, O, O, W, O, O, O, O, O, O, // 0x00  \t
+  O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, // 0x10
+  W, O, O, O, S, S, S, O, O, O, O, O, O, O, O, O, // 0x20  SP ! " # $ % & ' ( ) * + , - . /
+  S, S, S, S, S, S, S, S, S, S, O, O, O, O, O, S, // 0x30  0-9 : ; < = > ?
+  O, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, // 0x40  @ A-O
+  S, S, S, S, S, S, S, S, S, S, S, O, S, O, S, S, // 0x50  P-Z [ \ ] ^ _
+  O, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, // 0x60  ` a-o
+  S, S, S, S, S, S, S, S, S, S, S, O, S, O, S, O, // 0x70  p-z { | } ~ DEL
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, // 0x80
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+  U, U, U, U, U, U, U, U, U, U, U, U, U, U, U, U,
+};
+#undef O
+#undef S
+#undef W
+#undef U
+
+static inline ByteClass byteClass(char b) {
+  return (ByteClass)kByteClass[(uint8_t)b];
+}
+
 using Token = Lex::Token;
 
+// Fixed-capacity ring buffer of tokens queued up by the lexer, either for
+// semicolon insertion or by Lex::undoCurrent. The byte value of a queued token
+// is the source span described by its SrcLoc; `val` only holds the interpreted
+// value of literals that had one. Entry strings keep their capacity when
+// reused, so a queue in steady state does not allocate.
 struct TokQueue {
+  // The parser undoes at most one token on top of the lexer's own (at most
+  // one) queued token, so this leaves plenty of headroom.
+  static constexpr uint32_t Capacity = Lex::MaxQueuedTokens;
+
   struct Entry {
     Token  tok;
     SrcLoc loc;
-    string val;
+    string val; // interpreted value; empty if none
   };
 
-  std::deque<Entry> _q;
+  Entry    _q[Capacity];
+  uint32_t _head = 0; // index of first entry
+  uint32_t _size = 0; // number of entries
 
-  const Entry& first() const { return _q.front(); }
-  const Entry& last() const { return _q.back(); }
-  size_t size() const { return _q.size(); }
-  bool empty() const { return _q.empty(); }
+  const Entry& first() const { return _q[_head]; }
+  const Entry& at(uint32_t i) const { return _q[(_head + i) % Capacity]; }
+  const Entry& last() const { return _q[(_head + _size - 1) % Capacity]; }
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
 
-  // add to end of queue
-  void enqueueLast(Token tok, const SrcLoc& loc, const string& val) {
-    _q.emplace_back(Entry{tok, loc, val});
+  // add to end of queue. Returns false if the queue is full.
+  bool enqueueLast(Token tok, const SrcLoc& loc, const string& val) {
+    if (_size == Capacity) {
+      return false;
+    }
+    set(_q[(_head + _size) % Capacity], tok, loc, val);
+    ++_size;
+    return true;
   }
 
-  // add to beginning of queue
-  void enqueueFirst(Token tok, const SrcLoc& loc, const string& val) {
-    _q.emplace_front(Entry{tok, loc, val});
+  // add to beginning of queue. Returns false if the queue is full.
+  bool enqueueFirst(Token tok, const SrcLoc& loc, const string& val) {
+    if (_size == Capacity) {
+      return false;
+    }
+    _head = (_head + Capacity - 1) % Capacity;
+    set(_q[_head], tok, loc, val);
+    ++_size;
+    return true;
+  }
+
+  void clear() {
+    _head = 0;
+    _size = 0;
   }
 
   // dequeue the token+srcloc that's first in line
   void dequeueFirst(Token& tok, SrcLoc& loc, string& val) {
-    auto& ent = _q.front();
+    auto& ent = _q[_head];
     tok = ent.tok;
-    loc = std::move(ent.loc);
-    val = std::move(ent.val);
-    _q.pop_front();
+    loc = ent.loc;
+    val.swap(ent.val); // leaves val's old buffer in the slot for reuse
+    _head = (_head + 1) % Capacity;
+    --_size;
+  }
+
+private:
+  static void set(Entry& ent, Token tok, const SrcLoc& loc, const string& val) {
+    ent.tok = tok;
+    ent.loc = loc;
+    if (val.empty()) {
+      ent.val.clear();
+    } else {
+      ent.val.assign(val);
+    }
   }
 };
 
 struct Lex::Imp {
-  struct StackFrame {
-    Token t;
-    StackFrame(Token t) : t{t} {}
+  struct SpilledFrame {
+    bool     isInterpolation;
+    uint32_t below; // index+1 of the frame below this one in _spilled, or 0
   };
-  using Stack = std::stack<StackFrame>;
 
   const char* _begin;
   const char* _end;
@@ -98,10 +187,14 @@ struct Lex::Imp {
   Token       _tok;
   TokQueue    _tokQueue;
   uint32_t    _interpolatedTextDepth = 0;
-  const char* _lineBegin;
   SrcLoc      _srcLoc;
   Err         _err;
-  Stack       _stack;
+  uint64_t    _nesting = 0;      // bit stack of open "(" (0) and "\(" (1)
+  uint32_t    _nestingDepth = 0;
+  uint32_t    _nestingSpill = 0; // top of frames spilled from _nesting (see pushNesting)
+  std::vector<SpilledFrame> _spilled;
+  uint64_t    _backtracks = 0;
+  uint32_t    _identHash = 0; // IStr::hash of the current Identifier token
   string      _strval; // value of interpreted literals (string and char)
 
   Imp(const char* p, size_t z)
@@ -109,11 +202,17 @@ struct Lex::Imp {
     , _end{p+z}
     , _p{p}
     , _tok{Tokens::End}
-    , _lineBegin{p}
   {}
 
   UChar nextChar() {
-    return (_c = (_p < _end ? text::decodeUTF8Char(_p, _end) : UCharMax));
+    if (_p < _end) {
+      // ASCII fast path; only use the decoder when the high bit is set
+      if ((uint8_t)*_p < 0x80) {
+        return (_c = (uint8_t)*_p++);
+      }
+      return (_c = text::decodeValidUTF8Char(_p));
+    }
+    return (_c = UCharMax);
   }
 
   char nextByte() {
@@ -122,7 +221,17 @@ struct Lex::Imp {
 
   UChar peekNextChar() {
     auto p = _p;
-    return p < _end ? text::decodeUTF8Char(p, _end) : UCharMax;
+    if (p < _end) {
+      return (uint8_t)*p < 0x80 ? (uint8_t)*p : text::decodeValidUTF8Char(p);
+    }
+    return UCharMax;
+  }
+
+  // Advance past any bytes of class `bc` that immediately follow the cursor
+  void skipBytes(ByteClass bc) {
+    while (_p != _end && byteClass(*_p) == bc) {
+      ++_p;
+    }
   }
 
   void undoChar() {
@@ -157,7 +266,6 @@ struct Lex::Imp {
   //   UChar c;
   //   SrcLoc loc = _srcLoc;
   //   loc.offset = _p - _begin;
-  //   loc.column = _p - _lineBegin;
   //   while (p != _end) switch ((c = text::decodeUTF8Char(p, _end))) {
   //     CTRL_CASES
   //     WHITESPACE_CASES
@@ -182,7 +290,7 @@ struct Lex::Imp {
     if (t == End) {
       loc.length = 0;
     } else {
-      loc.length = (_p - _begin) - loc.offset;
+      loc.length = (uint32_t)(_p - _begin) - loc.offset;
     }
   }
 
@@ -191,24 +299,37 @@ struct Lex::Imp {
     return _tok = t;
   }
 
-  void enqueueToken(Token t, const string& value) {
+  Token setIdentTok() {
+    // Hash the identifier for interning while its bytes are still in cache,
+    // and use the hash to tell keywords apart from identifiers.
+    updateSrcLocLength(Identifier, _srcLoc);
+    const char* p = _begin + _srcLoc.offset;
+    _identHash = IStr::hash(p, _srcLoc.length);
+    int kw = lang_keywordIndex(p, _srcLoc.length, _identHash);
+    return _tok = (kw == -1) ? Identifier : kKeywordTokens[kw];
+  }
+
+  // Queue up tokens to be returned by next(). These return false when the
+  // queue is full, i.e. when a caller has undone more than MaxQueuedTokens.
+  bool enqueueToken(Token t, const string& value) {
     updateSrcLocLength(t, _srcLoc);
-    _tokQueue.enqueueLast(t, _srcLoc, value);
+    return _tokQueue.enqueueLast(t, _srcLoc, value);
   }
 
-  void enqueueTokenFirst(Token t, const string& value) {
+  bool enqueueTokenFirst(Token t, const string& value) {
     updateSrcLocLength(t, _srcLoc);
-    _tokQueue.enqueueFirst(t, _srcLoc, value);
+    return _tokQueue.enqueueFirst(t, _srcLoc, value);
   }
 
-  void beginTok() {
-    _srcLoc.offset = _p - _begin;
-    _srcLoc.column = _p - _lineBegin;
+  // Drops the queued tokens and sets an error. Returns Error.
+  Token queueOverflow() {
+    _tokQueue.clear();
+    _err = {"too many tokens queued"};
+    return Error;
   }
 
-  void incrLine() {
-    _srcLoc.line++;
-    _lineBegin = _p;
+  void beginTok() {
+    _srcLoc.offset = (uint32_t)(_p - _begin);
   }
 
   Token error(const string& msg) {
@@ -216,9 +337,40 @@ struct Lex::Imp {
     return setTok(Error);
   }
 
+  // Open parentheses and interpolations are tracked as a stack of bits so
+  // that the stack can be copied into a Snapshot. The innermost 64 frames
+  // live in _nesting. Frames pushed out of it are kept in _spilled, which
+  // is a stack that is only ever appended to: popping a frame just moves
+  // _nestingSpill to the frame below. That way a Snapshot only needs the
+  // index of the top spilled frame, which stays valid however the stack
+  // changes after the snapshot was taken.
+  void pushNesting(bool isInterpolation) {
+    if (_nestingDepth >= 64) {
+      _spilled.push_back({bool(_nesting >> 63), _nestingSpill});
+      _nestingSpill = uint32_t(_spilled.size());
+    }
+    _nesting = (_nesting << 1) | uint64_t(isInterpolation);
+    ++_nestingDepth;
+  }
+
+  bool popNesting() {
+    // returns true if the popped frame is an interpolation
+    assert(_nestingDepth > 0);
+    bool isInterpolation = _nesting & 1;
+    _nesting >>= 1;
+    --_nestingDepth;
+    if (_nestingDepth >= 64) {
+      auto& f = _spilled[_nestingSpill - 1];
+      _nesting |= uint64_t(f.isInterpolation) << 63;
+      _nestingSpill = f.below;
+    }
+    return isInterpolation;
+  }
+
 
   bool shouldInsertSemicolon() {
     return _tok == Identifier ||
+           isKeyword(_tok) ||
            (_tok > BeginLit && _tok < EndLit) ||
            _tok == U')' ||
            _tok == U']' ||
@@ -231,7 +383,6 @@ struct Lex::Imp {
   //   auto p = _p;
   //   auto c = _c;
   //   auto tok = _tok;
-  //   auto lineBegin = _lineBegin;
   //   auto srcLoc = _srcLoc;
 
   //   // read next
@@ -243,18 +394,11 @@ struct Lex::Imp {
   //   _p = p;
   //   _c = c;
   //   _tok = tok;
-  //   _lineBegin = lineBegin;
   //   _srcLoc = srcLoc;
   //   return false;
   // }
 
   Token next() {
-    if (_tok == '\n') {
-      // Increase line if previous token was a linebreak. This way linebreaks are
-      // semantically at the end of a line, rather than at the beginning of a line.
-      incrLine();
-    }
-
     // First, return the next queued token before reading more
     if (!_tokQueue.empty()) {
       _tokQueue.dequeueFirst(_tok, _srcLoc, _strval);
@@ -272,10 +416,14 @@ struct Lex::Imp {
     #define ADDSYM_OR \
       if (isReadingIdent) { break; } else
     #define ENDSYM_OR \
-      if (isReadingIdent) { undoChar(); return setTok(Identifier); } else
+      if (isReadingIdent) { undoChar(); return setIdentTok(); } else
 
     FOREACH_CHAR {
-      CTRL_CASES  WHITESPACE_CASES  ENDSYM_OR { beginTok(); break; } // ignore
+      CTRL_CASES  WHITESPACE_CASES  ENDSYM_OR { // ignore
+        skipBytes(BcSpace);
+        beginTok();
+        break;
+      }
 
       case '\n': ENDSYM_OR {
         // When the input is broken into tokens, a semicolon is automatically
@@ -286,7 +434,9 @@ struct Lex::Imp {
         //   • one of the keywords break, continue, fallthrough, or return
         //   • one of the operators and delimiters ++, --, ), ], or }
         if (shouldInsertSemicolon()) {
-          enqueueToken('\n', _strval);
+          if (!enqueueToken('\n', _strval)) {
+            return setTok(queueOverflow());
+          }
           return setTok(';');
         } else {
           return setTok('\n');
@@ -294,21 +444,18 @@ struct Lex::Imp {
       }
 
       case '(': ENDSYM_OR {
-        _stack.emplace('(');
+        pushNesting(false);
         return setTok(_c);
       }
 
       case ')': ENDSYM_OR {
-        if (_stack.empty()) {
+        if (_nestingDepth == 0) {
           return error("unbalanced parenthesis");
         }
-        auto popTok = _stack.top().t;
-        _stack.pop();
-        switch (popTok) {
-          case ITextLit:  return readTextLit(/*isInterpolated=*/true);
-          case '(':       return setTok(_c);
-          default:        assert(!"invalid stack state"); break;
+        if (popNesting()) {
+          return readTextLit(/*isInterpolated=*/true);
         }
+        return setTok(_c);
       }
 
       case '{': case '}':
@@ -335,7 +482,12 @@ struct Lex::Imp {
       case '`':   return readRawStringLit();
 
       default: {
-        if (text::isValidChar(_c)) {
+        if (_c < 0x80) {
+          // All ASCII characters are valid. Consume any run of ASCII symbol
+          // bytes following this one without dispatching on each of them.
+          isReadingIdent = true;
+          skipBytes(BcSym);
+        } else if (text::isValidChar(_c)) {
           isReadingIdent = true;
         } else {
           return error("Illegal character "+text::repr(_c)+" in input");
@@ -344,7 +496,7 @@ struct Lex::Imp {
       }
     }
 
-    return setTok(isReadingIdent ? Identifier : End);
+    return isReadingIdent ? setIdentTok() : setTok(End);
   }
 
 
@@ -410,7 +562,9 @@ struct Lex::Imp {
         }
 
         if (insertSemic) {
-          enqueueToken(_tok, _strval);
+          if (!enqueueToken(_tok, _strval)) {
+            return setTok(queueOverflow());
+          }
           return setTok(';');
         }
 
@@ -424,23 +578,16 @@ struct Lex::Imp {
 
   Token readGeneralComment(bool& hasNewline) {
     // Enter at "/*", leave at "*/"
+    // Only LF and "*" are of interest, and neither can be part of a multibyte
+    // UTF-8 sequence, so we scan bytes rather than decoding characters.
     hasNewline = false;
-    FOREACH_CHAR {
-      case '\n': {
+    while ((_p = bytescan::findAny(_p, _end, '\n', '*')) != _end) {
+      _c = (UChar)*_p++;
+      if (_c == '\n') {
         hasNewline = true;
-        incrLine();
-        break;
-      }
-      case '*': {
-        if (peekNextChar() == '/') {
-          nextChar(); // eat '/'
-          return setTok(GeneralComment);
-        }
-        fallthrough;
-      }
-      default: {
-        assert(_c != UCharMax); // FOREACH_CHAR should protect against this case
-        break;
+      } else if (_p != _end && *_p == '/') {
+        _c = (UChar)*_p++; // eat '/'
+        return setTok(GeneralComment);
       }
     }
     return error("unterminated general comment");
@@ -448,11 +595,8 @@ struct Lex::Imp {
 
 
   Token readLineComment() {
-    // Enter at "//"
-    FOREACH_CHAR {
-      case '\n': undoChar(); return setTok(LineComment);
-      default:   break;
-    }
+    // Enter at "//", leave before LF
+    _p = bytescan::findAny(_p, _end, '\n');
     return setTok(LineComment);
   }
 
@@ -463,10 +607,8 @@ struct Lex::Imp {
     while (nextChar() != '\n') {
       if (_c == UCharMax) { beginTok(); return setTok(End); }
     }
-    incrLine();
     beginTok();
     _p = _end;
-    _lineBegin = _p;
     return setTok(DataTail);
   }
 
@@ -546,10 +688,18 @@ struct Lex::Imp {
   Token readRawStringLitBuf() {
     // Called from readRawStringLit when we encounter a \r
     assignStrValTrimmed(); // `...\r => ...
-    while (_p != _end) switch (nextByte()) {
-      case '`':  return setTok(RawStringLit);
-      case '\r': break; // ignore
-      default: _strval += (char)_c; break; // store
+    while (_p != _end) {
+      // store everything up until the next "`" or \r
+      auto p = bytescan::findAny(_p, _end, '`', '\r');
+      _strval.append(_p, p - _p);
+      _p = p;
+      if (_p == _end) {
+        break;
+      }
+      if (nextByte() == '`') {
+        return setTok(RawStringLit);
+      }
+      // else: \r is ignored
     }
     return error("Unterminated raw string literal");
   }
@@ -557,19 +707,14 @@ struct Lex::Imp {
 
   Token readRawStringLit() {
     // RawStringLit = "`" { UnicodeChar | NewLine } "`"
-    while (_p != _end) switch (nextByte()) {
+    _p = bytescan::findAny(_p, _end, '`', '\r');
+    if (_p != _end) switch (nextByte()) {
       case '`': return setTok(RawStringLit);
       case '\r': {
         // \r is ignore because Windows, so we need to copy  all bytes read
         // so far into _strval and then ignore this byte.
         return readRawStringLitBuf();
       }
-      default: {
-        if (!_strval.empty()) {
-          _strval += (char)_c;
-        }
-        break;
-      }
     }
     return error("Unterminated raw string literal");
   }
@@ -577,43 +722,55 @@ struct Lex::Imp {
 
   Token readTextLit(bool isInterpolated) {
     // TextLit = '"' ( UnicodeChar | EscapedUnicodeChar<"> )* '"'
-    FOREACH_CHAR {
-      LINEBREAK_CASES return error("Illegal character in string literal");
-      case '"': {
-        if (isInterpolated) {
-          return setTok(ITextLitEnd);
-        } else {
-          return setTok(TextLit);
+    while (_p != _end) {
+      // Copy runs of printable ASCII straight to _strval. Anything else,
+      // including linebreaks and non-ASCII characters, is handled below.
+      auto p = bytescan::findAnyOrSpecial(_p, _end, '"', '\\');
+      if (p != _p) {
+        _strval.append(_p, p - _p);
+        _p = p;
+        if (_p == _end) {
+          break;
         }
       }
-      case '\\': {
-        if (peekNextChar() == '(') {
-          undoChar();
-          setTok(ITextLit);
-          _stack.emplace(_tok);
-          _p += 2; // skip past the "\(" which we previously parsed
-          return _tok;
+      switch (nextChar()) {
+        LINEBREAK_CASES return error("Illegal character in string literal");
+        case '"': {
+          if (isInterpolated) {
+            return setTok(ITextLitEnd);
+          } else {
+            return setTok(TextLit);
+          }
         }
-        if (!readCharLitEscape<'"'>()) {
-          return _tok;
+        case '\\': {
+          if (peekNextChar() == '(') {
+            undoChar();
+            setTok(ITextLit);
+            pushNesting(true);
+            _p += 2; // skip past the "\(" which we previously parsed
+            return _tok;
+          }
+          if (!readCharLitEscape<'"'>()) {
+            return _tok;
+          }
+          break;
         }
-        break;
-      }
-      default: {
+        default: {
 
-        #ifdef VALIDATE_UNICODE
-        switch (text::category(_c)) {
-          case text::Category::Unassigned:
-          case text::Category::NormativeCs: {
-            error(string{"Invalid Unicode character "} + text::repr(_c));
-            return false;
+          #ifdef VALIDATE_UNICODE
+          switch (text::category(_c)) {
+            case text::Category::Unassigned:
+            case text::Category::NormativeCs: {
+              error(string{"Invalid Unicode character "} + text::repr(_c));
+              return false;
+            }
+            default: break;
           }
-          default: break;
-        }
-        #endif // VALIDATE_UNICODE
+          #endif // VALIDATE_UNICODE
 
-        text::appendUTF8(_strval, _c);
-        break;
+          text::appendUTF8(_strval, _c);
+          break;
+        }
       }
     }
     return error("Unterminated string literal");
@@ -621,7 +778,7 @@ struct Lex::Imp {
 
 
   bool readHexUChar(int nbytes) {
-    const char* beginp = _p + 1;
+    const char* beginp = _p; // first hex digit
     int i = 0;
     while (i++ != nbytes) {
       switch (nextByte()) {
@@ -796,6 +953,71 @@ struct Lex::Imp {
   }
 
 
+  void saveSnapshot(Snapshot& s) const {
+    s.p = _p;
+    s.c = _c;
+    s.tok = _tok;
+    s.srcLoc = _srcLoc;
+    s.interpolatedTextDepth = _interpolatedTextDepth;
+    s.nesting = _nesting;
+    s.nestingDepth = _nestingDepth;
+    s.nestingSpill = _nestingSpill;
+    s.queueSize = _tokQueue.size();
+    for (uint32_t i = 0; i != s.queueSize; ++i) {
+      auto& ent = _tokQueue.at(i);
+      s.queue[i] = {ent.tok, ent.loc};
+    }
+  }
+
+  void loadSnapshot(const Snapshot& s) {
+    // Queued tokens first, since re-reading their values uses the scanner
+    _tokQueue.clear();
+    for (uint32_t i = 0; i != s.queueSize; ++i) {
+      auto& q = s.queue[i];
+      _srcLoc = q.loc;
+      rereadValue(q.tok);
+      _tokQueue.enqueueLast(q.tok, q.loc, _strval);
+    }
+    _srcLoc = s.srcLoc;
+    rereadValue(s.tok);
+    _p = s.p;
+    _c = s.c;
+    _tok = s.tok;
+    if (_tok == Identifier || isKeyword(_tok)) {
+      _identHash = IStr::hash(_begin + _srcLoc.offset, _srcLoc.length);
+    }
+    _interpolatedTextDepth = s.interpolatedTextDepth;
+    _nesting = s.nesting;
+    _nestingDepth = s.nestingDepth;
+    _nestingSpill = s.nestingSpill;
+  }
+
+  // Re-reads the interpreted value of token t at _srcLoc into _strval by
+  // scanning the literal again. Modifies scanner state; the caller is
+  // expected to restore it afterwards.
+  void rereadValue(Token t) {
+    _strval.clear();
+    switch (t) {
+      case CharLit:
+      case TextLit:
+      case ITextLit:
+      case ITextLitEnd:
+      case RawStringLit:
+        break;
+      default:
+        return; // no interpreted value
+    }
+    auto loc = _srcLoc;
+    _p = _begin + loc.offset + 1; // skip ' ` " or )
+    switch (t) {
+      case CharLit:      readCharLit(); break;
+      case RawStringLit: readRawStringLit(); break;
+      default:           readTextLit(/*isInterpolated=*/false); break;
+    }
+    _srcLoc = loc;
+  }
+
+
 };
 
 
@@ -819,7 +1041,10 @@ Token Lex::current() const {
   return self->_tok;
 }
 void Lex::undoCurrent() {
-  self->enqueueTokenFirst(self->_tok, self->_strval);
+  if (!self->enqueueTokenFirst(self->_tok, self->_strval)) {
+    // queue the error in place of the token, for next() to return
+    self->_tokQueue.enqueueFirst(self->queueOverflow(), self->_srcLoc, "");
+  }
 }
 Token Lex::queuedToken() {
   return self->_tokQueue.empty() ? Lex::Error : self->_tokQueue.first().tok;
@@ -839,6 +1064,13 @@ const char* Lex::byteTokValue(size_t& z) const {
   return self->_begin + self->_srcLoc.offset;
 }
 
+uint32_t Lex::tokHash() const {
+  if (self->_tok == Identifier || isKeyword(self->_tok)) {
+    return self->_identHash;
+  }
+  return IStr::hash(self->_begin + self->_srcLoc.offset, self->_srcLoc.length);
+}
+
 const std::string& Lex::interpretedTokValue() const {
   return self->_strval;
 }
@@ -872,20 +1104,24 @@ string Lex::repr(Token t, const string& value) {
   }
 }
 
-Lex::Snapshot Lex::createSnapshot() {
-  return Snapshot{new Imp{*self}};
+Lex::Snapshot Lex::createSnapshot() const {
+  Snapshot s;
+  self->saveSnapshot(s);
+  return s;
 }
 
 void Lex::restoreSnapshot(const Lex::Snapshot& snapshot) {
-  *self = *snapshot.self;
+  self->loadSnapshot(snapshot);
+  self->_backtracks++;
 }
 
 void Lex::swapSnapshot(Lex::Snapshot& snapshot) {
-  auto* s = self;
-  self = snapshot.self;
-  snapshot.self = s;
+  Snapshot s;
+  self->saveSnapshot(s);
+  self->loadSnapshot(snapshot);
+  snapshot = s;
 }
 
-Lex::Snapshot::~Snapshot() {
-  if (self) delete self;
+uint64_t Lex::backtrackCount() const {
+  return self->_backtracks;
 }
@@ -12,6 +12,16 @@
   T( DotDot,           0   )/*  ..   */ \
   T( DotDotDot,        0   )/*  ...  */ \
   T( Identifier,       1   )/*   */ \
+  T( BeginKeyword, '('     )/*  one per LANG_CONST_KEYWORDS  */ \
+    T( Kw_type,        0   )/*  type     */ \
+    T( Kw_func,        0   )/*  func     */ \
+    T( Kw_true,        0   )/*  true     */ \
+    T( Kw_false,       0   )/*  false    */ \
+    T( Kw_const,       0   )/*  const    */ \
+    T( Kw_struct,      0   )/*  struct   */ \
+    T( Kw_package,     0   )/*  package  */ \
+    T( Kw_import,      0   )/*  import   */ \
+  T( EndKeyword, ')'       )/*   */ \
   T( BeginLit, '('         )/*   */ \
     T( BeginNumLit, '('    )/*   */ \
       T( DecIntLit,    1   )/*   */ \
@@ -35,6 +45,9 @@
 
 struct Lex {
   using Token = UChar;
+
+  // Lex z bytes of source at p. The source must be valid UTF-8, as checked by
+  // text::findInvalidUTF8; characters are decoded without further checks.
   Lex(const char* p, size_t z);
   ~Lex();
 
@@ -53,6 +66,7 @@ struct Lex {
   // Queue current tok to be returned from next next() call.
   // Does not affect value of current(), only next().
   // Multiple subsequent calls have no effect.
+  // If more than MaxQueuedTokens are queued, next() returns Error.
   void undoCurrent();
   Token queuedToken(); // returns Error if none
 
@@ -77,6 +91,11 @@ struct Lex {
   std::string byteStringTokValue() const;
   void copyTokValue(std::string& s) const; // copies token value byte to s
 
+  // IStr::hash of the raw value of the current token. For Identifier and
+  // keyword tokens this is computed by the lexer as part of reading the
+  // token, so that an identifier can be interned without hashing it again.
+  uint32_t tokHash() const;
+
   // value of interpreted literals. (string and char)
   // This method returns an array of bytes that represent an interpreted
   // value, potentially different from the source-code bytes.
@@ -94,12 +113,22 @@ struct Lex {
   // Creates a string representation of a token suitable for display
   static std::string repr(Token, const std::string& value);
 
-  // Lexer state snapshotting and restoration
+  // Lexer state snapshotting and restoration.
+  // A Snapshot is a plain value: taking, copying and restoring one does not
+  // allocate. Interpreted values of literals are not stored in the snapshot
+  // but re-read from the source when a snapshot is restored.
   struct Snapshot;
-  Snapshot createSnapshot();
+  Snapshot createSnapshot() const;
   void restoreSnapshot(const Snapshot&);
   void swapSnapshot(Snapshot&);
 
+  // Number of times a snapshot has been restored, i.e. how often a speculative
+  // parse was undone. undoCurrent() is one-token lookahead and is not counted.
+  uint64_t backtrackCount() const;
+
+  // Max number of tokens that can be queued up at any one time
+  static constexpr uint32_t MaxQueuedTokens = 4;
+
   enum Tokens : Token {
     BeginSpecialTokens = 0xFFFFFF, // way past last valid Unicode point
     #define T(Name, HasValue) Name,
@@ -107,15 +136,27 @@ struct Lex {
     #undef T
   };
 
+  // Keywords are recognized by the lexer and produced as Kw_* tokens rather
+  // than as Identifier.
+  static bool isKeyword(Token t) { return t > BeginKeyword && t < EndKeyword; }
+
 private:
   struct Imp; Imp* self = nullptr;
 public:
   struct Snapshot {
-    Snapshot() {}
-    Snapshot(Imp*s) : self{s} {}
-    Snapshot(const Snapshot&) = delete;
-    Snapshot(Snapshot&&) = default;
-    ~Snapshot();
-    Imp* self = nullptr;
+    struct QueuedTok {
+      Token  tok;
+      SrcLoc loc;
+    };
+    const char* p;
+    UChar       c;
+    Token       tok;
+    SrcLoc      srcLoc;
+    uint32_t    interpolatedTextDepth;
+    uint64_t    nesting;      // bit stack of open "(" (0) and "\(" (1)
+    uint32_t    nestingDepth;
+    uint32_t    nestingSpill; // frames nested deeper than 64 (see Lex::Imp)
+    uint32_t    queueSize;
+    QueuedTok   queue[MaxQueuedTokens];
   };
 };
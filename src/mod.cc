@@ -123,6 +123,12 @@ AstNode* Module::findNamed(const IStr& name) {
 }
 
 
+void Module::removeNamed(const IStr& name) {
+  _idents.erase(name);
+  _typedefs.erase(name);
+}
+
+
 TypeDef* Module::addType(const IStr& name) {
   Type* ty;
   if (_nfreeType != 0) {
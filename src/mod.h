@@ -26,6 +26,7 @@ struct Module {
   // Otherwise null is returned and n is associated with name.
   AstNode* addNamed(const IStr& name, AstNode& n);
   AstNode* findNamed(const IStr& name); // null if not found
+  void removeNamed(const IStr& name); // forgets name, e.g. when its declaration is reparsed
 
   Type* addType(const IStr& name);
   const Type* findType(const IStr& name);
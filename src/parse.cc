@@ -1,8 +1,11 @@
 #include "parse.h"
 #include "lex.h"
+#include "tokstream.h"
 #include "defer.h"
 #include "langconst.h"
 #include "strtoint.h"
+#include "text.h"
+#include <algorithm>
 #include <iostream>
 #include <assert.h>
 
@@ -34,34 +37,34 @@ using Token = Lex::Token;
 
 struct parse {
   Stage          stage;
-  Lex            lex;
-  IStr::WeakSet& strings;
+  TokReader      toks;
+  IStr::SharedSet& strings;
   Module&        mod;
   Token          tok;
   Err            err;    // last error
   AstAllocator*  aa = nullptr;
 
-  parse(const char* sp, size_t len, IStr::WeakSet& s, Module& m)
+  parse(TokStream&& ts, IStr::SharedSet& s, Module& m)
     : stage{Stage::Pkg}
-    , lex{sp, len}
+    , toks{std::move(ts)}
     , strings{s}
     , mod{m}
   {}
 
   Token tokCurr() const {
-    return lex.current();
+    return toks.current();
   }
 
   // Read and return the next token. Skips leading comments and newlines.
   Token tokNext(bool acceptEnd=false) {
-    while ((tok = lex.next()) == '\n' ||
+    while ((tok = toks.next()) == '\n' ||
             (tok > Lex::BeginComment && tok < Lex::EndComment) )
     {}
     switch (tok) {
       case Lex::End: {
         if (acceptEnd) {
           #ifdef DEBUG_LOG_TOKEN
-          DEBUG_LOG_TOKEN(Lex::repr(tok, lex.byteStringTokValue()));
+          DEBUG_LOG_TOKEN(Lex::repr(tok, toks.byteStringTokValue()));
           #endif
           return tok;
         }
@@ -78,7 +81,7 @@ struct parse {
       }
     }
     #ifdef DEBUG_LOG_TOKEN
-    DEBUG_LOG_TOKEN(Lex::repr(tok, lex.byteStringTokValue()));
+    DEBUG_LOG_TOKEN(Lex::repr(tok, toks.byteStringTokValue()));
     #endif
     return tok;
   }
@@ -86,7 +89,7 @@ struct parse {
   // Advance lexer only if the upcoming token is `pred`
   // Note: This method does not skip leading comments or newlines.
   bool tokNextIfEq(Token pred) {
-    auto queuedTok = lex.queuedToken();
+    auto queuedTok = toks.queuedToken();
     if (queuedTok != Lex::Error && queuedTok != pred) {
       // avoid dequeue-enqueue
       return false;
@@ -100,19 +103,19 @@ struct parse {
   }
 
   void tokUndo() {
-    lex.undoCurrent();
+    toks.undoCurrent();
   }
 
   IStr tokIStr() {
     size_t z;
-    const char* p = lex.byteTokValue(z);
-    return strings.get(p, (uint32_t)z);
+    const char* p = toks.byteTokValue(z);
+    return strings.get(p, (uint32_t)z, toks.tokHash());
   }
 
   AstNode* allocNode(AstType t) {
     auto n = aa->alloc();
     n->type = t;
-    n->loc = lex.srcLoc();
+    n->loc = toks.srcLoc();
     return n;
   }
 
@@ -134,11 +137,13 @@ struct parse {
   AstNode* error(Err&& e) {
     #ifdef DEBUG_TRAP_ON_ERROR
     if (!e.ok()) {
+      auto& ts = toks.stream();
+      auto pos = SrcLines{ts.src(), ts.srcSize()}.pos(toks.srcLoc());
       std::cerr << "error: " << e.message() << " "
-                << (lex.srcLoc().line+1) << ':'
-                << (lex.srcLoc().column+1) << std::endl
-                << "lex.current() = "
-                << Lex::repr(lex.current(), lex.byteStringTokValue()) << std::endl
+                << (pos.line+1) << ':'
+                << (pos.column+1) << std::endl
+                << "toks.current() = "
+                << Lex::repr(toks.current(), toks.byteStringTokValue()) << std::endl
                 ;
       abort();
     }
@@ -149,12 +154,15 @@ struct parse {
   }
 
   AstNode* error(const char* msg) { return error(Err(ParseErrSyntax, msg)); }
-  AstNode* lexerror() { return error(lex.takeLastError()); }
+  AstNode* lexerror() { return error(toks.takeLastError()); }
   AstNode* lexend() { return error(Err::OK()); }
 };
 
-Parser::Parser(const char* sp, size_t len, IStr::WeakSet& s, Module& m)
-  : _p{new parse{sp, len, s, m}} {}
+Parser::Parser(const char* sp, size_t len, IStr::SharedSet& s, Module& m)
+  : _p{new parse{TokStream{sp, len}, s, m}} {}
+
+Parser::Parser(TokStream&& ts, IStr::SharedSet& s, Module& m)
+  : _p{new parse{std::move(ts), s, m}} {}
 
 Parser::~Parser() { if (_p) { delete _p; _p = nullptr; } }
 
@@ -179,12 +187,11 @@ bool parse_semic(parse& p) {
 
 
 AstNode* make_Ident(parse& p, bool allowKeyword=false) {
-  auto s = p.tokIStr();
-  if (!allowKeyword && lang_isKeyword(s)) {
+  if (!allowKeyword && Lex::isKeyword(p.tokCurr())) {
     return p.error("reserved keyword");
   }
   auto n = p.allocNode(AstIdent);
-  n->value.str = std::move(s);
+  n->value.str = p.tokIStr();
   return n;
 }
 
@@ -193,7 +200,7 @@ AstNode* parse_Ident(parse& p, bool needToken, bool allowKeyword=false) {
   if (needToken) {
     p.tokNext();
   }
-  if (p.tokCurr() != Lex::Identifier) {
+  if (p.tokCurr() != Lex::Identifier && !Lex::isKeyword(p.tokCurr())) {
     return p.error("unexpected token; expecting identifier");
   }
   return make_Ident(p, allowKeyword);
@@ -203,13 +210,13 @@ AstNode* parse_Ident(parse& p, bool needToken, bool allowKeyword=false) {
 // Makes n into Ident,
 // and if the next token is ".", makes n into and parses a QualIdent.
 bool make_IdentAndMaybeParseQual(parse& p, AstNode& n, bool allowKeyword=false) {
-  assert(p.tokCurr() == Lex::Identifier);
-  n.type = AstIdent;
-  n.value.str = p.tokIStr();
-  if (!allowKeyword && lang_isKeyword(n.value.str)) {
+  assert(p.tokCurr() == Lex::Identifier || Lex::isKeyword(p.tokCurr()));
+  if (!allowKeyword && Lex::isKeyword(p.tokCurr())) {
     p.error("reserved keyword");
     return false;
   }
+  n.type = AstIdent;
+  n.value.str = p.tokIStr();
 
   // qualified?
   auto n2 = &n;
@@ -229,7 +236,7 @@ bool make_IdentAndMaybeParseQual(parse& p, AstNode& n, bool allowKeyword=false)
 
 // Parses Ident or QualIdent
 AstNode* parse_IdentAny(parse& p, bool needToken, bool allowKeyword=false) {
-  if (needToken && p.tokNext() != Lex::Identifier) {
+  if (needToken && p.tokNext() != Lex::Identifier && !Lex::isKeyword(p.tokCurr())) {
     return p.error("unexpected token; expecting identifier");
   }
   auto n = p.allocNode(AstIdent);
@@ -261,7 +268,7 @@ AstNode* parse_Type(parse& p, bool needToken, Type* ty=nullptr);
 AstNode* make_IntConst(parse& p, int base) {
   auto n = p.allocNode(AstIntConst);
   size_t len = 0;
-  const char* pch = p.lex.byteTokValue(len);
+  const char* pch = p.toks.byteTokValue(len);
   // Note: If the following assertions fail, Lex's read*IntLit is broken.
   if (base != 10) {
     assert(len > 1);
@@ -299,6 +306,20 @@ AstNode* make_IntConst(parse& p, int base) {
 };
 
 
+AstNode* make_FloatConst(parse& p) {
+  auto n = p.allocNode(AstFloatConst);
+  size_t len = 0;
+  const char* pch = p.toks.byteTokValue(len);
+  if (!strtof64(pch, len, n->value.f)) {
+    // Note: If this happens, Lex's readFloatLit is broken.
+    dlog("strtof64 received \"" << std::string(pch, len) << "\"");
+    assert(!"strtof64");
+  }
+  n->ty = p.mod.types.kF64;
+  return n;
+}
+
+
 AstNode* parse_PrimaryExpr(parse& p, bool needToken) {
   // PrimaryExpr =
   //   Operand |
@@ -336,35 +357,27 @@ AstNode* parse_PrimaryExpr(parse& p, bool needToken) {
     case Lex::Error: return nullptr;
 
     case Lex::Identifier: {
-      auto n = parse_IdentAny(p, /*needToken=*/false, /*allowKeyword=*/true);
-      if (n == nullptr) {
-        return nullptr;
-      }
-      switch (n->value.str.hash()) {
-        case kLang_true_hash: {
-          n->type = AstBool;
-          n->ty = p.mod.types.kBool;
-          n->value.i = 1;
-          break;
-        }
-        case kLang_false_hash: {
-          n->type = AstBool;
-          n->ty = p.mod.types.kBool;
-          n->value.i = 0;
-          break;
-        }
-        case kLang_type_hash:
-        case kLang_func_hash: {
-          return p.error("unexpected keyword");
-        }
-        default: {
-          // Ident
-          break;
-        }
-      }
+      // Ident | QualIdent
+      return parse_IdentAny(p, /*needToken=*/false, /*allowKeyword=*/true);
+    }
+
+    case Lex::Kw_true:
+    case Lex::Kw_false: {
+      auto n = p.allocNode(AstBool);
+      n->ty = p.mod.types.kBool;
+      n->value.i = (tok == Lex::Kw_true) ? 1 : 0;
       return n;
     }
 
+    case Lex::Kw_type:
+    case Lex::Kw_func:
+    case Lex::Kw_const:
+    case Lex::Kw_struct:
+    case Lex::Kw_package:
+    case Lex::Kw_import: {
+      return p.error("unexpected keyword");
+    }
+
     case Lex::DecIntLit: {
       return make_IntConst(p, 10);
     }
@@ -375,15 +388,18 @@ AstNode* parse_PrimaryExpr(parse& p, bool needToken) {
       return make_IntConst(p, 16);
     }
 
-    // case Lex::FloatLit:
+    case Lex::FloatLit: {
+      return make_FloatConst(p);
+    }
+
     // case Lex::CharLit:
 
     case Lex::RawStringLit: {
       auto n = p.allocNode(AstRawString);
-      auto& str = p.lex.interpretedTokValue();
+      auto& str = p.toks.interpretedTokValue();
       if (str.empty()) {
         size_t len;
-        const char* pch = p.lex.byteTokValue(len);
+        const char* pch = p.toks.byteTokValue(len);
         if (len > 2) {
           n->value.str = IStr(pch+1, len-2);
         } else {
@@ -399,7 +415,7 @@ AstNode* parse_PrimaryExpr(parse& p, bool needToken) {
 
     case Lex::TextLit: {
       auto n = p.allocNode(AstString);
-      auto& str = p.lex.interpretedTokValue();
+      auto& str = p.toks.interpretedTokValue();
       if (str.size() < 20) {
         // intern short strings
         n->value.str = p.strings.get(str);
@@ -696,7 +712,7 @@ AstNode* parse_StructType(parse& p, Type* ty) {
 
     // end of struct
     case '}': {
-      n->loc.extend(p.lex.srcLoc());
+      n->loc.extend(p.toks.srcLoc());
       return n;
     }
 
@@ -715,30 +731,22 @@ AstNode* parse_Type(parse& p, bool needToken, Type* ty) {
   //           | SliceType | MapType | ChannelType
   switch (needToken ? p.tokNext() : p.tokCurr()) {
 
+    // StructType "struct"
+    case Lex::Kw_struct: {
+      return parse_StructType(p, tdef);
+    }
+    // TODO: InterfaceType "interface"
+    // TODO: FunctionType "func"
+
     case Lex::Identifier: {
-      // StructType "struct" |
-      // InterfaceType "interface" |
-      // FunctionType "func" |
       // TypeName
-      auto s = p.tokIStr();
-      switch (s.hash()) {
-        case IStr::hash("struct"): {
-          return parse_StructType(p, tdef);
-        }
-        // TODO: interface
-        // TODO: func
-
-        default: {
-          // alias for TypeName
-          auto n = parse_IdentAny(p, /*needToken=*/false);
-          if (n == nullptr) {
-            return nullptr;
-          }
-          n->ty = p.mod.typeofTypename(*n);
-          p.mod.regUnresolvedType(*n);
-          return n;
-        }
+      auto n = parse_IdentAny(p, /*needToken=*/false);
+      if (n == nullptr) {
+        return nullptr;
       }
+      n->ty = p.mod.typeofTypename(*n);
+      p.mod.regUnresolvedType(*n);
+      return n;
     }
 
     // —— HERE —— build n->ty
@@ -746,7 +754,7 @@ AstNode* parse_Type(parse& p, bool needToken, Type* ty) {
 
     case '*': {
       // PointerType = "*" Type
-      auto loc = p.lex.srcLoc();
+      auto loc = p.toks.srcLoc();
       auto tn = parse_Type(p, /*needToken=*/true);
       if (tn == nullptr) {
         return nullptr;
@@ -1303,12 +1311,12 @@ AstNode* parse_FuncDecl(parse& p) {
         case Lex::Error: return error();
         case Lex::Identifier: {
           n->value.str = p.tokIStr();
-          if (lang_isKeyword(n->value.str)) {
-            return error("reserved keyword");
-          }
           break;
         }
         default: {
+          if (Lex::isKeyword(p.tokCurr())) {
+            return error("reserved keyword");
+          }
           return error("unexpected token; expecting method name");
         }
       }
@@ -1426,35 +1434,29 @@ AstNode* parse_Declaration(parse& p, bool topLevel) {
   while (1) switch (p.tokNext(/*acceptEnd=*/true)) {
     case Lex::Error: return p.lexerror();
     case Lex::End:   return p.lexend();
-    case Lex::Identifier: {
-      auto s = p.tokIStr();
-      switch (s.hash()) {
-
-        case IStr::hash("const"): {
-          return parse_ConstDecl(p);
-        }
-
-        case kLang_type_hash: {
-          return parse_TypeDecl(p);
-        }
+    case Lex::Kw_const: {
+      return parse_ConstDecl(p);
+    }
 
-        case kLang_func_hash: {
-          if (!topLevel) {
-            return p.error("reserved keyword");
-          }
-          return parse_FuncDecl(p);
-        }
+    case Lex::Kw_type: {
+      return parse_TypeDecl(p);
+    }
 
-        case IStr::hash("package"):
-        case IStr::hash("import"): {
-          return p.error("reserved keyword");
-        }
+    case Lex::Kw_func: {
+      if (!topLevel) {
+        return p.error("reserved keyword");
       }
+      return parse_FuncDecl(p);
+    }
+
+    case Lex::Kw_package:
+    case Lex::Kw_import: {
+      return p.error("reserved keyword");
     }
 
     default: {
       std::cerr << "parse_Declaration: ignore "
-                << Lex::repr(p.tokCurr(), p.lex.byteStringTokValue())
+                << Lex::repr(p.tokCurr(), p.toks.byteStringTokValue())
                 << std::endl;
     }
   }
@@ -1503,7 +1505,7 @@ Err parse_importDecl(parse& p, Imports& imps) {
     }
   };
 
-  while (1) switch (p.lex.next()) {
+  while (1) switch (p.toks.next()) {
     case '(': {
       // e.g. `import ( ... )`
       if (multi) {
@@ -1535,8 +1537,8 @@ Err parse_importDecl(parse& p, Imports& imps) {
     case Lex::TextLit: {
       // e.g. `import "foo";`
       // e.g. `import ( "foo"; );`
-      ImportSpecs& s = imps[p.lex.interpretedTokValue()];
-      auto res = s.emplace(ImportSpec{pkgName, p.lex.srcLoc()});
+      ImportSpecs& s = imps[p.toks.interpretedTokValue()];
+      auto res = s.emplace(ImportSpec{pkgName, p.toks.srcLoc()});
       if (!res.second) {
         // duplicate import
         return Err(ParseErrSyntax, "duplicate import");
@@ -1564,17 +1566,13 @@ Err parse_importDecl(parse& p, Imports& imps) {
         static constexpr auto dotStr = ConstIStr(".");
         pkgName->value.str = dotStr;
       } else { // Lex::Identifier
-        auto s = p.tokIStr();
-        if (lang_isKeyword(s)) {
-          return Err("reserved keyword");
-        }
-        pkgName->value.str = s;
+        pkgName->value.str = p.tokIStr();
       }
       break;
     }
 
     case Lex::Error: {
-      return p.lex.takeLastError();
+      return p.toks.takeLastError();
     }
 
     case Lex::End: {
@@ -1610,13 +1608,10 @@ Err Parser::parsePkgDecl(AstPkgDecl& pkg) {
       p.stage = Stage::End;
       return Err::OK();
     }
-    case Lex::Identifier: {
-      if (p.lex.tokValueCmp("package") == 0) {
-        // TODO: set comment, if any
-        pkg.doc.clear();
-        break;
-      }
-      fallthrough;
+    case Lex::Kw_package: {
+      // TODO: set comment, if any
+      pkg.doc.clear();
+      break;
     }
     default: {
       return Err(ParseErrSyntax, "unexpected token; expecting \"package\"");
@@ -1627,7 +1622,7 @@ Err Parser::parsePkgDecl(AstPkgDecl& pkg) {
   switch (p.tokNext()) {
     case Lex::Error: return p.err;
     case Lex::Identifier: {
-      if (p.lex.tokValueCmp("_") == 0) {
+      if (p.toks.tokValueCmp("_") == 0) {
         return Err(ParseErr, "invalid package name");
       }
       pkg.name = p.tokIStr();
@@ -1675,7 +1670,6 @@ Err Parser::parseImports(AstAllocator& astalloc, Imports& imps) {
   auto& p = *_p;
   p.aa = &astalloc;
 
-  auto& lex = p.lex;
   bool done = false;
 
   while (!done) switch (p.tokNext(/*acceptEnd=*/true)) {
@@ -1686,15 +1680,12 @@ Err Parser::parseImports(AstAllocator& astalloc, Imports& imps) {
       done = true;
       break;
     }
-    case Lex::Identifier: {
-      if (_p->lex.tokValueCmp("import") == 0) {
-        auto err = parse_importDecl(*_p, imps);
-        if (!err.ok()) {
-          return err;
-        }
-        break;
+    case Lex::Kw_import: {
+      auto err = parse_importDecl(*_p, imps);
+      if (!err.ok()) {
+        return err;
       }
-      fallthrough;
+      break;
     }
     default: {
       // Something not "import" -- queue token for AST parser.
@@ -1709,7 +1700,38 @@ Err Parser::parseImports(AstAllocator& astalloc, Imports& imps) {
 }
 
 
-Err Parser::parseProgram(AstAllocator& astalloc, AstNode& prog) {
+// Parses top-level declarations until the end of input, calling
+// onDecl(AstNode&, uint32_t offset) for each one with the source offset
+// where it begins. The first one begins at `offset` and every other one
+// right after the last token of the one before it, e.g. a ";".
+template <typename F>
+static Err parse_TopLevelDecls(parse& p, uint32_t offset, F onDecl) {
+  while (1) {
+    auto node = parse_Declaration(p, /*topLevel=*/true);
+    if (!node) {
+      if (!p.toks.isValid()) {
+        return Err::OK(); // EOF
+      }
+      assert(!p.err.ok() ||!"missing error report");
+      return p.err;
+    }
+    onDecl(*node, offset);
+    auto& loc = p.toks.srcLoc();
+    offset = loc.offset + loc.length;
+  }
+}
+
+
+// Sets the lengths of spans so that each ends where the next one begins
+static void finishDeclSpans(DeclSpans& spans) {
+  for (size_t i = 0; i != spans.decls.size(); ++i) {
+    uint32_t end = (i + 1 != spans.decls.size()) ? spans.decls[i+1].offset : spans.end;
+    spans.decls[i].length = end - spans.decls[i].offset;
+  }
+}
+
+
+Err Parser::parseProgram(AstAllocator& astalloc, AstNode& prog, DeclSpans* spans) {
   if (_p == nullptr || _p->stage != Stage::AST) {
     return Err("invalid parser state");
   }
@@ -1717,22 +1739,271 @@ Err Parser::parseProgram(AstAllocator& astalloc, AstNode& prog) {
   _p->stage = Stage::End;
   _p->aa = &astalloc;
 
-  while (1) {
-    auto node = parse_Declaration(*_p, /*topLevel=*/true);
-    if (!node) {
-      if (!_p->lex.isValid()) {
-        break; // EOF
+  if (spans != nullptr) {
+    spans->begin = _p->toks.nextOffset();
+    spans->end = (uint32_t)_p->toks.stream().srcSize();
+    spans->decls.clear();
+  }
+
+  auto err = parse_TopLevelDecls(*_p, _p->toks.nextOffset(), [&](AstNode& node,
+                                                                uint32_t offset) {
+    prog.appendChild(node);
+    if (spans != nullptr) {
+      SrcLoc loc;
+      loc.offset = offset;
+      spans->decls.push_back(loc);
+    }
+  });
+
+  if (spans != nullptr) {
+    finishDeclSpans(*spans);
+  }
+  return err;
+}
+
+
+// Adds delta to the source offset of n and all of its descendants
+static void shiftSrcLocs(AstNode& n, int64_t delta) {
+  n.loc.offset = uint32_t(int64_t(n.loc.offset) + delta);
+  for (auto cn = n.children.first; cn != nullptr; cn = cn->nextSib) {
+    shiftSrcLocs(*cn, delta);
+  }
+}
+
+
+Err Parser::reparseProgram(const char* sp, size_t len, IStr::SharedSet& strings,
+                           Module& mod, AstAllocator& astalloc, AstNode& prog,
+                           DeclSpans& spans, const std::vector<SrcEdit>& edits,
+                           ReparseResult& result, SrcLoc& errloc)
+{
+  result = ReparseResult{};
+  if (edits.empty()) {
+    return Err::OK();
+  }
+  if (edits.front().offset < spans.begin) {
+    result.needFullParse = true;
+    return Err::OK();
+  }
+
+  std::vector<AstNode*> nodes; // old top-level nodes
+  for (auto n = prog.children.first; n != nullptr; n = n->nextSib) {
+    nodes.push_back(n);
+  }
+  size_t ndecls = nodes.size();
+  assert(ndecls == spans.decls.size());
+
+  // Find the declarations touched by an edit. An edit at the boundary
+  // between two declarations touches both, since it might change where
+  // either of them ends.
+  std::vector<bool> dirty(ndecls);
+  auto declAt = [&](uint32_t offset) { // last declaration beginning at or before offset
+    auto it = std::upper_bound(spans.decls.begin(), spans.decls.end(), offset,
+      [](uint32_t offset, const SrcLoc& loc) { return offset < loc.offset; });
+    return size_t(it - spans.decls.begin()) - 1;
+  };
+  for (size_t ei = 0; ei != edits.size(); ++ei) {
+    auto& e = edits[ei];
+    assert(ei == 0 || e.offset >= edits[ei-1].offset + edits[ei-1].length);
+    if (ndecls == 0) {
+      break;
+    }
+    size_t lo = declAt(e.offset);
+    size_t hi = declAt(e.offset + e.length);
+    if (lo != 0 && spans.decls[lo].offset == e.offset) {
+      --lo;
+    }
+    for (size_t i = lo; i <= hi; ++i) {
+      dirty[i] = true;
+    }
+  }
+
+  // Maps offsets of the old source to the new one. Offsets must be passed in
+  // increasing order. When inclusive, an edit at offset itself is counted.
+  size_t ei = 0;
+  int64_t delta = 0;
+  auto deltaAt = [&](uint32_t offset, bool inclusive) {
+    while (ei != edits.size() &&
+           (edits[ei].offset < offset || (inclusive && edits[ei].offset == offset)))
+    {
+      delta += int64_t(edits[ei].newLength) - int64_t(edits[ei].length);
+      ++ei;
+    }
+    return delta;
+  };
+
+  std::vector<AstNode*> newNodes;   // top-level nodes of the new program
+  std::vector<SrcLoc>   newSpans;
+  std::vector<bool>     isNew;
+  std::vector<std::pair<AstNode*,int64_t>> shifts; // kept nodes to shift
+  std::vector<AstNode*> oldNodes;   // nodes to free when done
+  uint32_t declsBegin = spans.begin; // first token after the imports, as parseProgram
+
+  // Frees a new declaration and removes its names from the module
+  auto discard = [&](AstNode* n) {
+    ast_forEachDeclName(*n, [&](AstNode& name) {
+      mod.removeNamed(name.value.str);
+      return true;
+    });
+    astalloc.free(n);
+  };
+
+  // Names of old declarations that have been removed from the module, with
+  // what they were associated with
+  std::vector<std::pair<IStr,AstNode*>> unnamed;
+
+  // Undoes everything, leaving prog and mod as they were
+  auto fail = [&](Err&& err) {
+    for (size_t i = 0; i != newNodes.size(); ++i) {
+      if (isNew[i]) {
+        discard(newNodes[i]);
       }
-      assert(!_p->err.ok() ||!"missing error report");
-      return _p->err;
     }
-    prog.appendChild(*node);
+    for (auto& e : unnamed) {
+      mod.addNamed(e.first, *e.second);
+    }
+    result = ReparseResult{};
+    return std::move(err);
+  };
+
+  bool emptyRun = ndecls == 0; // edits to a program without declarations
+  for (size_t i = 0; i < ndecls || emptyRun; ) {
+    if (!emptyRun && !dirty[i]) {
+      // Keep declaration i, which is only moved by edits before it
+      SrcLoc loc = spans.decls[i];
+      int64_t d = deltaAt(loc.offset, false);
+      loc.offset = uint32_t(loc.offset + d);
+      newNodes.push_back(nodes[i]);
+      newSpans.push_back(loc);
+      isNew.push_back(false);
+      if (d != 0) {
+        shifts.emplace_back(nodes[i], d);
+      }
+      ++result.reused;
+      ++i;
+      continue;
+    }
+    emptyRun = false;
+
+    // Reparse the run of touched declarations [i,j). If that fails, the
+    // run might have lost its end (e.g. an unclosed "{") so it's extended
+    // with the next declaration and tried again, up to the end of source.
+    size_t j = i;
+    while (j < ndecls && dirty[j]) {
+      ++j;
+    }
+    uint32_t oldBegin = i < ndecls ? spans.decls[i].offset : spans.begin;
+    uint32_t newBegin = uint32_t(oldBegin + deltaAt(oldBegin, false));
+    size_t nkept = newNodes.size();
+    uint32_t validEnd = newBegin; // new source up to here is valid UTF-8
+    for (size_t k = i; ; ) {
+      // Names declared by the old declarations would otherwise clash with
+      // the new ones
+      for (; k != j; ++k) {
+        ast_forEachDeclName(*nodes[k], [&](AstNode& name) {
+          if (auto n = mod.findNamed(name.value.str)) {
+            unnamed.emplace_back(name.value.str, n);
+            mod.removeNamed(name.value.str);
+          }
+          return true;
+        });
+      }
+
+      uint32_t oldEnd = j < ndecls ? spans.decls[j].offset : spans.end;
+      uint32_t newEnd = uint32_t(oldEnd + deltaAt(oldEnd, true));
+
+      // The lexer decodes without checks, so validate what it will read
+      size_t badOffset = validEnd + text::findInvalidUTF8(sp + validEnd, newEnd - validEnd);
+      if (badOffset != newEnd) {
+        errloc.offset = (uint32_t)badOffset;
+        errloc.length = 1;
+        return fail(Err(ParseErrEncoding, "invalid UTF-8 data"));
+      }
+      validEnd = newEnd;
+
+      SrcLoc range;
+      range.offset = newBegin;
+      range.length = newEnd - newBegin;
+      parse p{TokStream{sp, len, range}, strings, mod};
+      p.stage = Stage::AST;
+      p.aa = &astalloc;
+
+      Err err;
+      if (newBegin == spans.begin) {
+        // An import added after the existing ones is not a declaration but
+        // changes the imports
+        auto tok = p.tokNext(/*acceptEnd=*/true);
+        if (tok == Lex::Kw_import) {
+          fail(Err::OK());
+          result.needFullParse = true;
+          return Err::OK();
+        }
+        if (tok == Lex::Error) {
+          err = p.err;
+        } else {
+          // Whitespace or comments inserted before the first token move it
+          p.tokUndo();
+          declsBegin = p.toks.nextOffset();
+        }
+      }
+      if (!err) {
+        err = parse_TopLevelDecls(p, newBegin, [&](AstNode& node, uint32_t offset) {
+          SrcLoc loc;
+          loc.offset = offset;
+          newNodes.push_back(&node);
+          newSpans.push_back(loc);
+          isNew.push_back(true);
+        });
+      }
+      if (!err) {
+        break;
+      }
+      if (j == ndecls) {
+        errloc = p.toks.srcLoc();
+        return fail(std::move(err));
+      }
+      for (size_t n = nkept; n != newNodes.size(); ++n) {
+        discard(newNodes[n]);
+      }
+      newNodes.resize(nkept);
+      newSpans.resize(nkept);
+      isNew.resize(nkept);
+      ++j;
+    }
+
+    for (size_t k = i; k != j; ++k) {
+      oldNodes.push_back(nodes[k]);
+    }
+    i = j;
+  }
+
+  // Success; update the program
+  for (auto& s : shifts) {
+    shiftSrcLocs(*s.first, s.second);
+  }
+  for (auto n : oldNodes) {
+    astalloc.free(n);
+  }
+  result.freed = (uint32_t)oldNodes.size();
+  prog.children = {};
+  for (size_t i = 0; i != newNodes.size(); ++i) {
+    prog.appendChild(*newNodes[i]);
+    if (isNew[i]) {
+      result.changed.push_back(newNodes[i]);
+    }
   }
 
+  spans.begin = declsBegin;
+  spans.end = (uint32_t)len;
+  spans.decls = std::move(newSpans);
+  if (!spans.decls.empty()) {
+    // Anything between the imports and the first declaration belongs to it
+    spans.decls[0].offset = spans.begin;
+  }
+  finishDeclSpans(spans);
   return Err::OK();
 }
 
 
 const SrcLoc& Parser::srcLoc() const {
-  return _p->lex.srcLoc();
+  return _p->toks.srcLoc();
 }
@@ -6,25 +6,80 @@
 #include "istr.h"
 #include "mod.h"
 #include <stdlib.h>
+#include <vector>
 
 // opaque parser implementation data
 struct parse;
+struct TokStream;
 
 // Error codes
 enum ParseErrCode : Err::Code {
   ParseErr,
   ParseErrSyntax,
+  ParseErrEncoding, // source is not valid UTF-8
+};
+
+// Where the top-level declarations of a program are in its source.
+// Declaration i spans from its first token (or a comment or newline before
+// it) up to where declaration i+1 begins, so that together the spans cover
+// the source from `begin` to `end` with no gaps.
+struct DeclSpans {
+  uint32_t            begin = 0;  // first token after package clause and imports
+  uint32_t            end = 0;    // end of source
+  std::vector<SrcLoc> decls;      // one per top-level node of the program
+};
+
+// A change to a source: `length` bytes at `offset` were replaced with
+// `newLength` bytes. Offsets refer to the source before any of the edits.
+struct SrcEdit {
+  uint32_t offset;
+  uint32_t length;
+  uint32_t newLength;
+};
+
+// What Parser::reparseProgram did
+struct ReparseResult {
+  std::vector<AstNode*> changed;  // top-level nodes that were parsed anew, in order
+  uint32_t reused = 0;            // top-level nodes kept from the previous parse
+  uint32_t freed = 0;             // top-level nodes that were replaced or removed
+  bool     needFullParse = false; // the package clause or imports were edited
 };
 
 // Parser allows partially or completely parsing a translation unit
 struct Parser {
-  // Construct a parser that will parse source code at sp of len bytes
-  Parser(const char* sp, size_t len, IStr::WeakSet&, Module&);
+  // Construct a parser that will parse source code at sp of len bytes.
+  // The source must be valid UTF-8 (see text::findInvalidUTF8.)
+  Parser(const char* sp, size_t len, IStr::SharedSet&, Module&);
+
+  // Construct a parser that will parse a pre-lexed token stream
+  Parser(TokStream&&, IStr::SharedSet&, Module&);
 
   // Parse source in the following sequence:
   Err parsePkgDecl(AstPkgDecl& pkgdecl);      // parse package declaration, then
   Err parseImports(AstAllocator&, Imports&);  // parse any import declarations, then
-  Err parseProgram(AstAllocator&, AstNode&);  // parse any program.
+  Err parseProgram(AstAllocator&, AstNode&, DeclSpans* spans=nullptr); // parse any program.
+
+  // Incrementally updates a program after its source was edited.
+  //
+  // `prog` and `spans` are from parsing the old source with parseProgram or
+  // reparseProgram, and `edits`, sorted by offset and not overlapping, turn
+  // the old source into the new source at `sp`. Only runs of declarations
+  // touched by an edit are lexed and parsed again, starting at the beginning
+  // of the first one. Other top-level nodes are kept, and their SrcLocs are
+  // shifted to match the new source. On return prog and spans describe the
+  // new source and `result` tells which top-level nodes changed.
+  //
+  // The edited declarations are checked to be valid UTF-8 before they are
+  // lexed, and ParseErrEncoding is returned if they are not.
+  //
+  // If an edit touched the package clause or imports, or added an import
+  // after them, nothing is done and result.needFullParse is set. On error,
+  // prog, spans and the module are left as they were and the error's
+  // location is stored in errloc.
+  static Err reparseProgram(const char* sp, size_t len, IStr::SharedSet&, Module&,
+                            AstAllocator&, AstNode& prog, DeclSpans& spans,
+                            const std::vector<SrcEdit>& edits, ReparseResult&,
+                            SrcLoc& errloc);
 
   // TODO: Flag to parseProgram that includes comments in the AST
 
@@ -1,6 +1,16 @@
 #include "readfile.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+  #include <copyfile.h>
+#elif defined(__linux__)
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+#endif
 
 char* readfile(FILE* f, size_t& outLen, size_t maxSize) {
   const size_t blocksize = 4096;
@@ -47,3 +57,118 @@ char* readfile(FILE* f, size_t& outLen, size_t maxSize) {
   outLen = uintptr_t(p) - uintptr_t(sp);
   return sp;
 }
+
+static const char kEmptyFile[1] = {0};
+
+const char* mapfile(FILE* f, size_t& outLen, size_t maxSize) {
+  int fd = fileno(f);
+  struct stat st;
+
+  outLen = 0;
+
+  if (fstat(fd, &st) != 0) {
+    return nullptr;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    errno = ENODEV;
+    return nullptr;
+  }
+  if (size_t(st.st_size) > maxSize) {
+    errno = EFBIG;
+    return nullptr;
+  }
+  if (st.st_size == 0) {
+    // mmap does not accept zero-length mappings
+    return kEmptyFile;
+  }
+
+  void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+
+  outLen = size_t(st.st_size);
+  return (const char*)p;
+}
+
+void unmapfile(const char* p, size_t len) {
+  if (p != kEmptyFile) {
+    munmap((void*)p, len);
+  }
+}
+
+
+#if defined(__APPLE__)
+
+bool cpfile(const char* srcpath, const char* dstpath) {
+  // Clones on APFS and falls back to copying elsewhere
+  return copyfile(srcpath, dstpath, nullptr, COPYFILE_CLONE | COPYFILE_DATA) == 0;
+}
+
+#else
+
+// Copies by reading and writing, for when the kernel can't do it for us
+static bool copyfd(int src, int dst) {
+  char buf[64 * 1024];
+  while (1) {
+    ssize_t n = read(src, buf, sizeof(buf));
+    if (n <= 0) {
+      return n == 0;
+    }
+    for (ssize_t w = 0; w < n; ) {
+      ssize_t m = write(dst, buf + w, size_t(n - w));
+      if (m < 0) {
+        return false;
+      }
+      w += m;
+    }
+  }
+}
+
+bool cpfile(const char* srcpath, const char* dstpath) {
+  int src = open(srcpath, O_RDONLY | O_CLOEXEC);
+  if (src == -1) {
+    return false;
+  }
+  int dst = open(dstpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (dst == -1) {
+    int e = errno;
+    close(src);
+    errno = e;
+    return false;
+  }
+  bool ok = false;
+  #if defined(__linux__)
+  ok = ioctl(dst, FICLONE, src) == 0;
+  if (!ok) {
+    // Not on the same filesystem, or no reflinks there. copy_file_range
+    // still avoids copying through user space.
+    while (1) {
+      ssize_t n = copy_file_range(src, nullptr, dst, nullptr, 1 << 30, 0);
+      if (n <= 0) {
+        ok = n == 0;
+        break;
+      }
+    }
+    if (!ok && (errno == EXDEV || errno == EINVAL || errno == ENOSYS) &&
+        lseek(src, 0, SEEK_SET) == 0 && lseek(dst, 0, SEEK_SET) == 0 &&
+        ftruncate(dst, 0) == 0)
+    {
+      ok = copyfd(src, dst);
+    }
+  }
+  #else
+  ok = copyfd(src, dst);
+  #endif
+  int e = errno;
+  close(src);
+  if (close(dst) != 0 && ok) {
+    ok = false;
+    e = errno;
+  }
+  errno = e;
+  return ok;
+}
+
+#endif
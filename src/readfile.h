@@ -5,3 +5,19 @@
 // Read up to maxSize bytes from f. Returns nullptr and sets errno on error.
 // Caller is responsible for free()ing the returned pointer.
 char* readfile(FILE* f, size_t& outLen, size_t maxSize);
+
+// Map up to maxSize bytes of the file f into memory, read-only, with a hint
+// that the pages will be accessed sequentially. Returns nullptr and sets errno
+// on error. errno is ENODEV when f is not a regular file (e.g. a pipe or a
+// terminal) in which case readfile should be used instead.
+// Caller is responsible for unmapfile()ing the returned pointer.
+const char* mapfile(FILE* f, size_t& outLen, size_t maxSize);
+
+// Unmap memory previously returned by mapfile.
+void unmapfile(const char* p, size_t len);
+
+// Copy the file at srcpath to dstpath, replacing any file there. Where the
+// filesystem supports it the copy shares storage with the source (a reflink
+// or clone), otherwise the kernel copies the data without it passing through
+// user space, if it can. Returns false and sets errno on error.
+bool cpfile(const char* srcpath, const char* dstpath);
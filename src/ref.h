@@ -113,6 +113,15 @@ enum RefTransfer_ { RefTransfer };
     } \
     RX_REF_MIXIN_BODY(T, Imp)
 
+#define RX_REF_MIXIN_NOVTABLE_IMMORTAL(T) \
+  /* Like RX_REF_MIXIN_NOVTABLE but for types whose instances are never freed */ \
+  public: \
+    struct Imp; friend Imp; \
+    static void __dealloc(Imp*); \
+    static void __retain(Imp*) {} \
+    static bool __release(Imp*) { return false; } \
+    RX_REF_MIXIN_BODY(T, Imp)
+
 
 #define RX_REF_MIXIN_BODY(T,Imp) \
   Imp* self = nullptr; \
@@ -0,0 +1,390 @@
+#include "server.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+
+namespace server {
+namespace {
+
+// Wire format. Both ends run on the same host, so integers are sent in host
+// byte order.
+//
+//   request  = u32 count, count * (u32 size, byte[size])  -- cwd, args...
+//   response = frame*
+//   frame    = u8 kind, u32 size, byte[size]
+//
+// The last frame of a response is an exit frame with the exit status as a
+// 4-byte int.
+enum FrameKind : uint8_t {
+  FrameStdout = 'o',
+  FrameStderr = 'e',
+  FrameExit   = 'x',
+};
+
+// Limits on what a server accepts from a client. Arguments are mostly file
+// names, so a request is small; the limits only keep a bad client from
+// making the server allocate a lot of memory.
+constexpr uint32_t kMaxArgs = 4096;
+constexpr uint32_t kMaxRequestSize = 1 << 20; // all args together, in bytes
+
+// Max number of commands run at the same time. Each one runs on a thread of
+// its own and may start more threads, so further clients wait in the
+// listen queue until a command finishes.
+constexpr unsigned kMaxConns = 4;
+
+// Seconds a client may take to send its request, and to take each part of
+// the response, before it is disconnected
+constexpr int kReadTimeout = 10;
+constexpr int kWriteTimeout = 60;
+
+bool writeAll(int fd, const void* p, size_t size) {
+  auto bp = (const char*)p;
+  while (size != 0) {
+    ssize_t n = ::write(fd, bp, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bp += n;
+    size -= size_t(n);
+  }
+  return true;
+}
+
+// Reads exactly size bytes. Returns false on error or end of stream.
+bool readAll(int fd, void* p, size_t size) {
+  auto bp = (char*)p;
+  while (size != 0) {
+    ssize_t n = ::read(fd, bp, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (n == 0) {
+      errno = ECONNRESET;
+      return false;
+    }
+    bp += n;
+    size -= size_t(n);
+  }
+  return true;
+}
+
+bool writeU32(int fd, uint32_t v) {
+  return writeAll(fd, &v, sizeof(v));
+}
+
+bool readU32(int fd, uint32_t& v) {
+  return readAll(fd, &v, sizeof(v));
+}
+
+bool writeFrame(int fd, FrameKind kind, const char* p, size_t size) {
+  uint8_t k = kind;
+  return writeAll(fd, &k, 1) && writeU32(fd, uint32_t(size)) && writeAll(fd, p, size);
+}
+
+// Stream buffer which sends what is written to it as frames of one kind.
+// Output is sent when the buffer fills up and whenever the stream is
+// flushed, so that e.g. "endl" reaches the client right away. Once the
+// connection breaks, output is dropped.
+struct FrameBuf : std::streambuf {
+  int       fd;
+  FrameKind kind;
+  bool&     broken; // shared by the streams of a connection
+  char      buf[4096];
+
+  FrameBuf(int fd, FrameKind kind, bool& broken) : fd{fd}, kind{kind}, broken{broken} {
+    setp(buf, buf + sizeof(buf));
+  }
+
+  int sync() override {
+    size_t size = size_t(pptr() - pbase());
+    if (size != 0 && !broken) {
+      broken = !writeFrame(fd, kind, pbase(), size);
+    }
+    setp(buf, buf + sizeof(buf));
+    return 0;
+  }
+
+  int_type overflow(int_type c) override {
+    sync();
+    if (c != traits_type::eof()) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+};
+
+bool readRequest(int fd, Request& req) {
+  uint32_t count;
+  if (!readU32(fd, count) || count == 0 || count > kMaxArgs) {
+    return false;
+  }
+  std::vector<std::string> strs(count);
+  uint32_t total = 0;
+  for (auto& s : strs) {
+    uint32_t size;
+    if (!readU32(fd, size) || size > kMaxRequestSize - total) {
+      return false;
+    }
+    total += size;
+    s.resize(size);
+    if (size != 0 && !readAll(fd, &s[0], size)) {
+      return false;
+    }
+  }
+  req.cwd = std::move(strs[0]);
+  req.args.assign(std::make_move_iterator(strs.begin() + 1),
+                  std::make_move_iterator(strs.end()));
+  return true;
+}
+
+void handleConn(int fd, const Handler& handler) {
+  Request req;
+  if (readRequest(fd, req)) {
+    bool broken = false;
+    FrameBuf outbuf{fd, FrameStdout, broken};
+    FrameBuf errbuf{fd, FrameStderr, broken};
+    std::ostream out{&outbuf};
+    std::ostream err{&errbuf};
+    int32_t status = handler(req, out, err);
+    out.flush();
+    err.flush();
+    if (!broken) {
+      writeFrame(fd, FrameExit, (const char*)&status, sizeof(status));
+    }
+  }
+  ::close(fd);
+}
+
+bool setAddr(sockaddr_un& addr, const char* sockpath, std::string& errmsg) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    errmsg = std::string(sockpath) + ": socket path too long";
+    return false;
+  }
+  strcpy(addr.sun_path, sockpath);
+  return true;
+}
+
+void setTimeout(int fd, int optname, int seconds) {
+  timeval tv{seconds, 0};
+  ::setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
+// True if the process at the other end of fd runs as the same user as we do.
+// The socket file is only accessible to that user (see serve), which is
+// checked here again where the system tells who connected.
+bool peerIsOwner(int fd) {
+#if defined(__APPLE__)
+  uid_t uid;
+  gid_t gid;
+  return ::getpeereid(fd, &uid, &gid) == 0 && uid == ::geteuid();
+#elif defined(SO_PEERCRED)
+  ucred cred;
+  socklen_t size = sizeof(cred);
+  return ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0 &&
+         cred.uid == ::geteuid();
+#else
+  return true;
+#endif
+}
+
+// Counts free connection slots. take() blocks until one is free.
+struct Slots {
+  std::mutex              mu;
+  std::condition_variable cond;
+  unsigned                free;
+
+  explicit Slots(unsigned n) : free{n} {}
+
+  void take() {
+    std::unique_lock<std::mutex> lock(mu);
+    cond.wait(lock, [this] { return free != 0; });
+    --free;
+  }
+
+  void give() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      ++free;
+    }
+    cond.notify_one();
+  }
+};
+
+std::string errnoMsg(const char* sockpath) {
+  return std::string(sockpath) + ": " + strerror(errno);
+}
+
+// Connects to the server at sockpath. Returns -1 on error.
+int dial(const char* sockpath, std::string& errmsg) {
+  sockaddr_un addr;
+  if (!setAddr(addr, sockpath, errmsg)) {
+    return -1;
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    errmsg = errnoMsg(sockpath);
+    return -1;
+  }
+  if (::connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+    errmsg = errnoMsg(sockpath);
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+} // namespace
+
+
+void serve(const char* sockpath, const Handler& handler, std::string& errmsg) {
+  sockaddr_un addr;
+  if (!setAddr(addr, sockpath, errmsg)) {
+    return;
+  }
+
+  // Replace the socket of a server which is gone, but never steal one which
+  // is in use or remove something which isn't a socket.
+  struct stat st;
+  if (::stat(sockpath, &st) == 0) {
+    std::string ignored;
+    int fd = S_ISSOCK(st.st_mode) ? dial(sockpath, ignored) : -1;
+    if (fd != -1 || !S_ISSOCK(st.st_mode)) {
+      if (fd != -1) {
+        ::close(fd);
+      }
+      errmsg = std::string(sockpath) + ": address in use";
+      return;
+    }
+    ::unlink(sockpath);
+  }
+
+  // Only our own user may connect. Commands run as that user and write
+  // files wherever it may, e.g. with -o. The socket file is created with mode
+  // 0600 rather than changed after bind, which would leave a window in which
+  // anyone could connect.
+  int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t umaskWas = ::umask(0177);
+  bool bound = lfd != -1 && ::bind(lfd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+  ::umask(umaskWas);
+  if (!bound || ::listen(lfd, 128) != 0) {
+    errmsg = errnoMsg(sockpath);
+    if (lfd != -1) {
+      ::close(lfd);
+    }
+    return;
+  }
+
+  // A client which goes away mid-response must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+
+  // Slots outlive this function, since threads of connections may still be
+  // running when it returns
+  auto slots = std::make_shared<Slots>(kMaxConns);
+  while (1) {
+    slots->take();
+    int fd = ::accept(lfd, nullptr, nullptr);
+    if (fd == -1) {
+      slots->give();
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+          errno == ENFILE)
+      {
+        continue;
+      }
+      errmsg = errnoMsg(sockpath);
+      break;
+    }
+    if (!peerIsOwner(fd)) {
+      ::close(fd);
+      slots->give();
+      continue;
+    }
+    setTimeout(fd, SO_RCVTIMEO, kReadTimeout);
+    setTimeout(fd, SO_SNDTIMEO, kWriteTimeout);
+    std::thread([fd, &handler, slots] {
+      handleConn(fd, handler);
+      slots->give();
+    }).detach();
+  }
+  ::close(lfd);
+}
+
+
+int forward(const char* sockpath, const std::vector<std::string>& args,
+            std::string& errmsg)
+{
+  int fd = dial(sockpath, errmsg);
+  if (fd == -1) {
+    return -1;
+  }
+
+  std::string cwd;
+  if (char* p = ::getcwd(nullptr, 0)) {
+    cwd = p;
+    free(p);
+  }
+
+  bool ok = writeU32(fd, uint32_t(args.size() + 1)) &&
+            writeU32(fd, uint32_t(cwd.size())) &&
+            writeAll(fd, cwd.data(), cwd.size());
+  for (size_t i = 0; ok && i != args.size(); ++i) {
+    ok = writeU32(fd, uint32_t(args[i].size())) &&
+         writeAll(fd, args[i].data(), args[i].size());
+  }
+
+  int status = -1;
+  std::string data;
+  while (ok) {
+    uint8_t kind;
+    uint32_t size;
+    if (!readAll(fd, &kind, 1) || !readU32(fd, size)) {
+      ok = false;
+      break;
+    }
+    data.resize(size);
+    if (size != 0 && !readAll(fd, &data[0], size)) {
+      ok = false;
+      break;
+    }
+    if (kind == FrameExit && size == sizeof(int32_t)) {
+      int32_t v;
+      memcpy(&v, data.data(), sizeof(v));
+      status = v;
+      break;
+    }
+    if (kind == FrameStdout || kind == FrameStderr) {
+      int ofd = kind == FrameStdout ? STDOUT_FILENO : STDERR_FILENO;
+      if (!writeAll(ofd, data.data(), data.size())) {
+        ok = false;
+      }
+    }
+  }
+  if (!ok) {
+    errmsg = errnoMsg(sockpath);
+  }
+  ::close(fd);
+  return ok ? status : -1;
+}
+
+} // namespace server
@@ -0,0 +1,56 @@
+#pragma once
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Compile server.
+//
+// A server listens on a Unix domain socket and runs the commands of its
+// clients in its own process, so that no process is started per command and
+// state can be kept between commands: cox keeps interned strings and the
+// packages it built (see build::PackageStore), as well as what a process
+// computes once, like the compiler identity which cache keys include.
+//
+// Each connection carries one command. The client sends its working
+// directory and arguments, and the server streams back whatever the command
+// writes to stdout and stderr, as it is written, followed by the command's
+// exit status. A few connections are served concurrently, each on a thread
+// of its own; more wait until one of them is done.
+//
+// Only processes of the user running the server may connect, as commands
+// run with that user's permissions: files named by a client, e.g. with -o,
+// are read and written by the server.
+//
+//   // server
+//   server::serve("/tmp/cox.sock", [&](const server::Request& req,
+//                                      std::ostream& out, std::ostream& err) {
+//     return run(req.args, req.cwd, out, err);
+//   });
+//
+//   // client
+//   int status = server::forward("/tmp/cox.sock", args);
+//
+namespace server {
+
+struct Request {
+  std::string              cwd;   // working directory of the client
+  std::vector<std::string> args;  // arguments, including the program name
+};
+
+// Runs a command, writing its output to out and err. Returns exit status.
+using Handler = std::function<int(const Request&, std::ostream& out, std::ostream& err)>;
+
+// Listens on sockpath and handles connections until the process is killed.
+// A stale socket file at sockpath, i.e. one that nobody listens on, is
+// replaced. Returns only on error, with a message in errmsg.
+void serve(const char* sockpath, const Handler&, std::string& errmsg);
+
+// Sends args to the server at sockpath together with the current working
+// directory, and copies what the server sends back to stdout and stderr.
+// Returns the command's exit status, or -1 with a message in errmsg if the
+// server could not be reached or the connection broke.
+int forward(const char* sockpath, const std::vector<std::string>& args,
+            std::string& errmsg);
+
+} // namespace server
@@ -0,0 +1,26 @@
+#include "srcloc.h"
+#include "bytescan.h"
+#include <algorithm>
+
+SrcLines::SrcLines(const char* src, size_t len) {
+  const char* p = src;
+  const char* end = src + len;
+  _starts.push_back(0);
+  while ((p = bytescan::findAny(p, end, '\n')) != end) {
+    ++p;
+    _starts.push_back((uint32_t)(p - src));
+  }
+}
+
+
+SrcPos SrcLines::pos(uint32_t offset) const {
+  // Find the last line that starts at or before offset. A linebreak belongs
+  // to the line it ends.
+  auto it = std::upper_bound(_starts.begin(), _starts.end(), offset);
+  assert(it != _starts.begin());
+  --it;
+  SrcPos pos;
+  pos.line = (uint32_t)(it - _starts.begin());
+  pos.column = offset - *it;
+  return pos;
+}
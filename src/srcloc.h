@@ -1,15 +1,40 @@
 #pragma once
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
+#include <vector>
 
+// Location of a span of source code.
+// Line and column are not stored but resolved on demand with SrcLines.
 struct SrcLoc {
-  size_t   offset = 0; // byte offset into source
+  uint32_t offset = 0; // byte offset into source
   uint32_t length = 0; // number of source bytes
-  uint32_t line   = 0; // zero-based
-  uint32_t column = 0; // zero-based, expressed in source bytes (not Unicode chars)
 
   void extend(const SrcLoc& later) {
     assert((later.offset + later.length) > offset);
     length = (later.offset + later.length) - offset;
   }
 };
+
+// Line and column of a source offset
+struct SrcPos {
+  uint32_t line   = 0; // zero-based
+  uint32_t column = 0; // zero-based, expressed in source bytes (not Unicode chars)
+};
+
+// Table of line start offsets of a source file, used to resolve offsets into
+// line and column. Building it costs one scan over the source, so it should
+// be built when needed (e.g. when reporting a diagnostic) rather than upfront.
+struct SrcLines {
+  SrcLines(const char* src, size_t len);
+
+  // Returns line and column of the byte at offset
+  SrcPos pos(uint32_t offset) const;
+  SrcPos pos(const SrcLoc& loc) const { return pos(loc.offset); }
+
+  // Number of lines
+  uint32_t count() const { return (uint32_t)_starts.size(); }
+
+private:
+  std::vector<uint32_t> _starts; // offset of first byte of each line
+};
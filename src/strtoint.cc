@@ -1,6 +1,9 @@
 #include "strtoint.h"
 // #include <sys/cdefs.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
 // #include <errno.h>
 // #include <ctype.h>
 // #include <stdlib.h>
@@ -38,7 +41,8 @@ static inline bool strtou(const char* pch, size_t size, int base, UInt& result)
   cutoff = UIntMax;//ULLONG_MAX;
   cutlim = cutoff % base;
   cutoff /= base;
-  for (c = *s ; s != end; c = *s++) {
+  for (; s != end; ++s) {
+    c = *s;
     if (c >= '0' && c <= '9') {
       c -= '0';
     } else if (c >= 'A' && c <= 'Z') {
@@ -68,10 +72,246 @@ static inline bool strtou(const char* pch, size_t size, int base, UInt& result)
   return true;
 }
 
+
+// -----------------------------------------------------------------------------------------------
+// SWAR (SIMD within a register) conversion of 8 digits at a time.
+// Only used for inputs short enough that they can't overflow, so the
+// overflow semantics are those of strtou.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define RX_STRTOINT_SWAR 1
+#endif
+
+#if RX_STRTOINT_SWAR
+
+static const uint64_t kOnes = 0x0101010101010101ULL;
+static const uint64_t kHigh = 0x8080808080808080ULL;
+
+static inline uint64_t load8(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+// Loads n (<8) bytes, padded with leading '0's, so that the result can be
+// treated as 8 digits.
+static inline uint64_t load8pad(const char* p, size_t n) {
+  char buf[8];
+  memset(buf, '0', 8 - n);
+  memcpy(buf + (8 - n), p, n);
+  return load8(buf);
+}
+
+// Returns a mask with the high bit set for each byte in v that is in [lo,hi].
+// Requires all bytes of v to be < 0x80.
+static inline uint64_t bytesInRange(uint64_t v, uint8_t lo, uint8_t hi) {
+  return ~(v + kOnes * (127 - hi)) & (v + kOnes * (128 - lo)) & kHigh;
+}
+
+// True if all 8 bytes are decimal digits
+static inline bool isDec8(uint64_t v) {
+  return (v & kHigh) == 0 && bytesInRange(v, '0', '9') == kHigh;
+}
+
+// Converts 8 decimal digits (first digit in the lowest byte)
+static inline uint32_t dec8(uint64_t v) {
+  v -= kOnes * '0';
+  v = (v * 10) + (v >> 8); // pairs of digits
+  v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return (uint32_t)v;
+}
+
+// Converts 8 hexadecimal digits (first digit in the lowest byte).
+// Returns false if any byte is not a hex digit.
+static inline bool hex8(uint64_t v, uint32_t& result) {
+  if ((v & kHigh) != 0) {
+    return false;
+  }
+  uint64_t digit = bytesInRange(v, '0', '9');
+  uint64_t alpha = bytesInRange(v | (kOnes * 0x20), 'a', 'f');
+  if ((digit | alpha) != kHigh) {
+    return false;
+  }
+  // nibble value of each byte: digits are '0'..'9' = 0x30..0x39 and letters
+  // are 'A'..'F' = 0x41..0x46 or 'a'..'f' = 0x61..0x66.
+  v = (v & (kOnes * 0x0F)) + (alpha >> 7) * 9;
+  // combine nibbles, most significant first
+  v = ((v & 0x000F000F000F000FULL) << 4) | ((v & 0x0F000F000F000F00ULL) >> 8);
+  v = ((v & 0x000000FF000000FFULL) << 8) | ((v & 0x00FF000000FF0000ULL) >> 16);
+  v = ((v & 0x000000000000FFFFULL) << 16) | ((v & 0x0000FFFF00000000ULL) >> 32);
+  result = (uint32_t)v;
+  return true;
+}
+
+// Decimal number of at most maxDigits digits, which must not be able to
+// overflow UInt.
+template <typename UInt>
+static inline bool strtouDec(const char* p, size_t size, UInt& result) {
+  uint64_t acc = 0;
+  size_t head = size % 8;
+  if (head != 0) {
+    uint64_t v = load8pad(p, head);
+    if (!isDec8(v)) {
+      return false;
+    }
+    acc = dec8(v);
+    p += head;
+    size -= head;
+  }
+  for (; size != 0; size -= 8, p += 8) {
+    uint64_t v = load8(p);
+    if (!isDec8(v)) {
+      return false;
+    }
+    acc = acc * 100000000 + dec8(v);
+  }
+  result = (UInt)acc;
+  return true;
+}
+
+template <typename UInt>
+static inline bool strtouHex(const char* p, size_t size, UInt& result) {
+  uint64_t acc = 0;
+  uint32_t v;
+  size_t head = size % 8;
+  if (head != 0) {
+    if (!hex8(load8pad(p, head), v)) {
+      return false;
+    }
+    acc = v;
+    p += head;
+    size -= head;
+  }
+  for (; size != 0; size -= 8, p += 8) {
+    if (!hex8(load8(p), v)) {
+      return false;
+    }
+    acc = (acc << 32) | v;
+  }
+  result = (UInt)acc;
+  return true;
+}
+
+#endif // RX_STRTOINT_SWAR
+
+
 bool strtou64(const char* p, size_t size, int base, uint64_t& result) {
+  #if RX_STRTOINT_SWAR
+  // 19 decimal digits and 16 hex digits always fit in 64 bits
+  if (size != 0) {
+    if (base == 10 && size <= 19) {
+      return strtouDec(p, size, result);
+    }
+    if (base == 16 && size <= 16) {
+      return strtouHex(p, size, result);
+    }
+  }
+  #endif
   return strtou<uint64_t,0xffffffffffffffffULL>(p, size, base, result);
 }
 
 bool strtou32(const char* p, size_t size, int base, uint32_t& result) {
+  #if RX_STRTOINT_SWAR
+  // 9 decimal digits and 8 hex digits always fit in 32 bits
+  if (size != 0) {
+    if (base == 10 && size <= 9) {
+      return strtouDec(p, size, result);
+    }
+    if (base == 16 && size <= 8) {
+      return strtouHex(p, size, result);
+    }
+  }
+  #endif
   return strtou<uint32_t,0xffffffffU>(p, size, base, result);
 }
+
+
+// -----------------------------------------------------------------------------------------------
+
+static const double kExactPow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+bool strtof64(const char* p, size_t size, double& result) {
+  // Float = Digits? ("." Digits?)? (("e"|"E") ("+"|"-")? Digits)?
+  const char* s = p;
+  const char* end = p + size;
+  uint64_t mantissa = 0;
+  int ndigits = 0;    // significant digits in mantissa
+  int exp10 = 0;      // decimal exponent of mantissa
+  bool any = false;   // true when mantissa has at least one digit
+  bool truncated = false;
+
+  for (int frac = 0; frac != 2; ++frac) {
+    for (; s != end && *s >= '0' && *s <= '9'; ++s) {
+      any = true;
+      if (ndigits == 19) {
+        truncated = true; // too many digits for the fast path
+      } else if (mantissa != 0 || *s != '0') {
+        mantissa = mantissa * 10 + (*s - '0');
+        ++ndigits;
+      }
+      if (frac) {
+        --exp10;
+      } else if (truncated) {
+        ++exp10;
+      }
+    }
+    if (frac || s == end || *s != '.') {
+      break;
+    }
+    ++s; // skip "."
+  }
+  if (!any) {
+    return false;
+  }
+
+  if (s != end && (*s == 'e' || *s == 'E')) {
+    ++s;
+    bool neg = false;
+    if (s != end && (*s == '+' || *s == '-')) {
+      neg = (*s == '-');
+      ++s;
+    }
+    if (s == end) {
+      return false;
+    }
+    int e = 0;
+    for (; s != end && *s >= '0' && *s <= '9'; ++s) {
+      if (e < 100000) {
+        e = e * 10 + (*s - '0');
+      }
+    }
+    exp10 += neg ? -e : e;
+  }
+  if (s != end) {
+    return false;
+  }
+
+  // Clinger's fast path: when both the mantissa and the power of ten are
+  // exactly representable as doubles, a single correctly rounded
+  // multiplication or division gives the correctly rounded result.
+  if (!truncated && mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+    double d = (double)mantissa;
+    result = exp10 < 0 ? d / kExactPow10[-exp10] : d * kExactPow10[exp10];
+    return true;
+  }
+  if (mantissa == 0 && !truncated) {
+    result = 0.0;
+    return true;
+  }
+
+  // Fall back to the C library which is correctly rounded but needs a
+  // NUL-terminated string.
+  char buf[64];
+  if (size < sizeof(buf)) {
+    memcpy(buf, p, size);
+    buf[size] = '\0';
+    result = strtod(buf, nullptr);
+  } else {
+    result = strtod(std::string(p, size).c_str(), nullptr);
+  }
+  return true;
+}
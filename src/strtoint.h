@@ -11,3 +11,9 @@
 
 bool strtou64(const char* p, size_t size, int base, uint64_t& result);
 bool strtou32(const char* p, size_t size, int base, uint32_t& result);
+
+// Interprets `size` bytes at `p` as a decimal floating-point number of the form
+//   Digits? ("." Digits?)? (("e"|"E") ("+"|"-")? Digits)?
+// with at least one mantissa digit. The result is correctly rounded.
+// Returns true on success in which case result contains the value.
+bool strtof64(const char* p, size_t size, double& result);
@@ -11,6 +11,7 @@
 //   #define UTF8_NEXT(inI, inE) UTF8::next(inI, inE)
 // #endif
 
+#include "bytescan.h"
 #include <iostream>
 #include <vector>
 using std::cerr;
@@ -36,6 +37,54 @@ string encodeUTF8(const Text& t) {
 }
 
 
+size_t findInvalidUTF8(const char* src, size_t len) {
+  // ASCII runs are skipped 16 or 32 bytes at a time. Each multibyte sequence
+  // is then checked according to RFC 3629 (table 3-7 of the Unicode standard):
+  //
+  //   Lead       2nd        3rd        4th
+  //   C2..DF     80..BF
+  //   E0         A0..BF     80..BF
+  //   E1..EC     80..BF     80..BF
+  //   ED         80..9F     80..BF               (no surrogates)
+  //   EE..EF     80..BF     80..BF
+  //   F0         90..BF     80..BF     80..BF
+  //   F1..F3     80..BF     80..BF     80..BF
+  //   F4         80..8F     80..BF     80..BF    (max U+10FFFF)
+  //
+  const char* p = src;
+  const char* end = src + len;
+  while ((p = bytescan::findNonASCII(p, end)) != end) {
+    const uint8_t* s = (const uint8_t*)p;
+    uint8_t b = s[0];
+    uint8_t lo = 0x80, hi = 0xBF; // valid range of the second byte
+    size_t n;                     // number of continuation bytes
+    if (b < 0xC2) {
+      return p - src; // continuation byte without a lead, or overlong
+    } else if (b < 0xE0) {
+      n = 1;
+    } else if (b < 0xF0) {
+      n = 2;
+      if (b == 0xE0) { lo = 0xA0; } else if (b == 0xED) { hi = 0x9F; }
+    } else if (b < 0xF5) {
+      n = 3;
+      if (b == 0xF0) { lo = 0x90; } else if (b == 0xF4) { hi = 0x8F; }
+    } else {
+      return p - src;
+    }
+    if ((size_t)(end - p) <= n || s[1] < lo || s[1] > hi) {
+      return p - src;
+    }
+    for (size_t i = 2; i <= n; ++i) {
+      if ((s[i] & 0xC0) != 0x80) {
+        return p - src;
+      }
+    }
+    p += n + 1;
+  }
+  return len;
+}
+
+
 string encodeUTF8(UChar c) {
   std::string s;
   s.reserve(1);
@@ -160,29 +209,33 @@ string repr(const char* p, size_t len) {
 
 #include "text.def"
 
-static Category kCharCategoryMap[RX_TEXT_CHAR_MAP_SIZE] = {
-  #define CP(cp, Cat, Bidir, namestr)  (Category)RX_TEXT_CHAR_CAT_##Cat,
-  RX_TEXT_CHAR_MAP(CP)
-  #undef CP
+// Two-level category table: the block index maps each block of
+// 2^RX_TEXT_CHAR_CAT_BLOCK_SHIFT codepoints to a leaf of categories.
+// Blocks with identical contents share the same leaf.
+static const uint16_t kCharCategoryBlockIndex[RX_TEXT_CHAR_CAT_BLOCK_COUNT] = {
+  #define V(leaf) leaf,
+  RX_TEXT_CHAR_CAT_BLOCK_INDEX(V)
+  #undef V
+};
+
+static const Category kCharCategoryLeaves[
+  RX_TEXT_CHAR_CAT_LEAF_COUNT << RX_TEXT_CHAR_CAT_BLOCK_SHIFT] =
+{
+  #define V(cat) (Category)cat,
+  RX_TEXT_CHAR_CAT_LEAVES(V)
+  #undef V
 };
 
 
 Category category(UChar c) {
-  static_assert(RX_TEXT_CHAR_MAP_OFFSET == 0, "Expected Unicode map to start at U+0000");
-  if (c < RX_TEXT_CHAR_MAP_SIZE) {
-    return kCharCategoryMap[c];
-  } else {
-    switch (c) {
-      #define CP(cp)           case cp:
-      #define CR(StartC, EndC) case StartC ... EndC:
-      RX_TEXT_INVALID_MAP_ADDITION_RANGES(CP,CR)
-      #undef CP
-      #undef CR
-        return Category::Unassigned;
-      default:
-        return c <= RX_TEXT_LAST_VALID_CHAR ? Category::Assigned : Category::Unassigned;
-    }
+  static_assert(RX_TEXT_CHAR_CAT_ASSIGNED == Category::Assigned,
+                "Category enum out of sync with text.def");
+  constexpr UChar blockMask = (1 << RX_TEXT_CHAR_CAT_BLOCK_SHIFT) - 1;
+  if (c >= RX_TEXT_CHAR_CAT_LIMIT) {
+    return Category::Unassigned;
   }
+  uint32_t leaf = kCharCategoryBlockIndex[c >> RX_TEXT_CHAR_CAT_BLOCK_SHIFT];
+  return kCharCategoryLeaves[(leaf << RX_TEXT_CHAR_CAT_BLOCK_SHIFT) | (c & blockMask)];
 }
 
 
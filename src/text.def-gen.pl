@@ -571,6 +571,7 @@ my $bindirHash = {};
 # exit(0);
 
 my @BMPMapEntries = ();
+my @BMPCatFlags = (); # category flag by codepoint, undefined for unassigned
 
 for (my $i=0; $i != $BMPMapSize; $i++) {
   my $cphex = $i;
@@ -605,6 +606,7 @@ for (my $i=0; $i != $BMPMapSize; $i++) {
     $flag = $catTag.$pair->[1];
     push(@flags, $flag);
     $catHash->{$flag} = $description;
+    $BMPCatFlags[$i] = $flag;
 
     $description = '';
     if (defined $knownBidirectionalCategories{$pair->[2]}) {
@@ -668,6 +670,90 @@ print "#define RX_TEXT_CHAR_MAP_SIZE   ".$BMPMapSize."\n";
 print "#define RX_TEXT_CHAR_MAP(CP) \\\n";
 print '  CP( ' . join(") \\\n  CP( ", @BMPMapEntries).")\n";
 
+# Two-level category lookup table covering all of Unicode.
+# Codepoints are split into blocks of 2^RX_TEXT_CHAR_CAT_BLOCK_SHIFT. The block
+# index maps a block to a leaf, and blocks with identical contents share the
+# same leaf. The category of a codepoint is thus found with two loads:
+#   leaves[(blockIndex[cp >> SHIFT] << SHIFT) | (cp & ((1 << SHIFT) - 1))]
+# Values are the same as produced by the RX_TEXT_CHAR_MAP + invalid ranges
+# combination, with codepoints past the map being either UNASSIGNED or ASSIGNED.
+
+my $catBlockShift = 8;
+my $catBlockSize = 1 << $catBlockShift;
+my $catLimitCP = 0x110000;
+
+my %catValue = ();
+my $catValueAssigned = 0;
+foreach my $name (sort keys %$catHash) {
+  $catValue{$name} = ++$catValueAssigned;
+}
+++$catValueAssigned; # RX_TEXT_CHAR_CAT_MAX+1
+
+my @invalidCP = (); # true for codepoints in @invalidCodepointRanges
+foreach my $r (@invalidCodepointRanges) {
+  my ($startCP, $endCP);
+  if ($r =~ m/^CP\(0x([0-9A-Fa-f]+)\)$/) {
+    $startCP = $endCP = hex($1);
+  } elsif ($r =~ m/^CR\(0x([0-9A-Fa-f]+), 0x([0-9A-Fa-f]+)\)$/) {
+    $startCP = hex($1);
+    $endCP = hex($2);
+  } else {
+    die("Unexpected invalid codepoint range '$r'");
+  }
+  for (my $c = $startCP; $c <= $endCP; $c++) {
+    $invalidCP[$c] = 1;
+  }
+}
+
+sub charCategoryValue {
+  my ($cp) = @_;
+  if ($cp < $BMPMapLimitCP) {
+    my $flag = $BMPCatFlags[$cp];
+    return defined $flag ? $catValue{$flag} : 0;
+  }
+  if ($invalidCP[$cp] || $cp > $lastValidCodepoint) {
+    return 0;
+  }
+  return $catValueAssigned;
+}
+
+my @catBlockIndex = ();
+my @catLeaves = ();
+my %catLeafByContents = ();
+for (my $blockCP = 0; $blockCP < $catLimitCP; $blockCP += $catBlockSize) {
+  my @values = ();
+  for (my $cp = $blockCP; $cp != $blockCP + $catBlockSize; $cp++) {
+    push(@values, charCategoryValue($cp));
+  }
+  my $contents = join(',', @values);
+  if (!defined $catLeafByContents{$contents}) {
+    $catLeafByContents{$contents} = scalar(@catLeaves);
+    push(@catLeaves, $contents);
+  }
+  push(@catBlockIndex, $catLeafByContents{$contents});
+}
+
+sub printNumbersDef {
+  my ($macroName, $perLine, @values) = @_;
+  print "#define $macroName(V) \\\n";
+  for (my $i = 0; $i < scalar(@values); $i += $perLine) {
+    my $end = $i + $perLine > scalar(@values) ? scalar(@values) : $i + $perLine;
+    print '  V(' . join(') V(', @values[$i..$end-1]) . ")";
+    print(($end == scalar(@values)) ? "\n" : " \\\n");
+  }
+  print "\n";
+}
+
+print "\n";
+print "// Two-level character category table (U+0000 ... U+".fmtcp($catLimitCP-1).")\n";
+print "#define RX_TEXT_CHAR_CAT_ASSIGNED     (RX_TEXT_CHAR_CAT_MAX+1)\n";
+print "#define RX_TEXT_CHAR_CAT_LIMIT        0x".fmtcp($catLimitCP)."\n";
+print "#define RX_TEXT_CHAR_CAT_BLOCK_SHIFT  ".$catBlockShift."\n";
+print "#define RX_TEXT_CHAR_CAT_BLOCK_COUNT  ".scalar(@catBlockIndex)."\n";
+print "#define RX_TEXT_CHAR_CAT_LEAF_COUNT   ".scalar(@catLeaves)."\n";
+printNumbersDef('RX_TEXT_CHAR_CAT_BLOCK_INDEX', 16, @catBlockIndex);
+printNumbersDef('RX_TEXT_CHAR_CAT_LEAVES', 32, map { split(/,/, $_) } @catLeaves);
+
 } # if ($opt_all || $opt_bmpmap)
 
 
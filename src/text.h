@@ -17,6 +17,16 @@ template <typename ByteIterator>
 UChar decodeUTF8Char(ByteIterator& it, const ByteIterator end);
   // Decode one character from a UTF8 string. Advances `it`.
 
+template <typename ByteIterator>
+UChar decodeValidUTF8Char(ByteIterator& it);
+  // Decode one character from a UTF8 string which is known to be valid, e.g.
+  // by findInvalidUTF8. Performs no checks. Advances `it`.
+
+size_t findInvalidUTF8(const char* p, size_t len);
+  // Validate UTF8 data. Returns the offset of the first byte of the first
+  // invalid (malformed, overlong, surrogate, out of range or truncated)
+  // sequence, or len if all of p is valid UTF8.
+
 string encodeUTF8(const Text&);
 string encodeUTF8(UChar);
   // Convert Unicode text into a UTF8 string.
@@ -93,6 +103,11 @@ inline UChar decodeUTF8Char(ByteIterator& it, const ByteIterator end) {
   return utf8::unchecked::next(it, end);
 }
 
+template <typename ByteIterator>
+inline UChar decodeValidUTF8Char(ByteIterator& it) {
+  return utf8::unchecked::next(it);
+}
+
 inline string repr(const string& str) {
   return repr(str.data(), str.size());
 }
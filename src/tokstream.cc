@@ -0,0 +1,221 @@
+#include "tokstream.h"
+#include "istr.h"
+#include <algorithm>
+#include <assert.h>
+
+using std::string;
+using Token = Lex::Token;
+
+static_assert(Lex::DataTail - Lex::BeginSpecialTokens < 0x80,
+              "too many Lex::Tokens to fit in a compact token kind");
+
+uint8_t TokStream::packKind(Token t) {
+  if (t > Lex::BeginSpecialTokens) {
+    return (uint8_t)(0x80 + (t - Lex::BeginSpecialTokens - 1));
+  }
+  assert(t < 0x80 || !"non-ASCII token");
+  return (uint8_t)t;
+}
+
+Token TokStream::unpackKind(uint8_t k) {
+  if (k < 0x80) {
+    return k;
+  }
+  return (Token)Lex::BeginSpecialTokens + 1 + (k - 0x80);
+}
+
+
+TokStream::TokStream(const char* src, size_t len) : _src{src}, _srclen{len} {
+  lex(0, (uint32_t)std::min(len, (size_t)UINT32_MAX));
+}
+
+
+TokStream::TokStream(const char* src, size_t len, const SrcLoc& range)
+  : _src{src}, _srclen{len}
+{
+  assert(range.offset + range.length <= len);
+  lex(range.offset, range.offset + range.length);
+}
+
+
+void TokStream::lex(uint32_t begin, uint32_t end) {
+  if (_srclen > UINT32_MAX) {
+    _err = Err("source too large");
+    _kinds.push_back(packKind(Lex::Error));
+    _offsets.push_back(0);
+    _lengths.push_back(0);
+    _hashes.push_back(0);
+    return;
+  }
+
+  // Guess about one token per 4 bytes of source to avoid most regrowth
+  size_t estimate = (end - begin) / 4 + 1;
+  _kinds.reserve(estimate);
+  _offsets.reserve(estimate);
+  _lengths.reserve(estimate);
+  _hashes.reserve(estimate);
+
+  Lex lex{_src + begin, end - begin};
+  while (1) {
+    auto t = lex.next();
+    auto& loc = lex.srcLoc();
+    _kinds.push_back(packKind(t));
+    _offsets.push_back(begin + loc.offset);
+    _lengths.push_back(loc.length);
+    _hashes.push_back((t == Lex::Identifier || Lex::isKeyword(t)) ? lex.tokHash() : 0);
+
+    auto& val = lex.interpretedTokValue();
+    if (!val.empty() && t > Lex::BeginLit && t < Lex::EndLit) {
+      _valTokens.push_back(size() - 1);
+      _valOffsets.push_back((uint32_t)_valBytes.size());
+      _valBytes.append(val);
+    }
+
+    if (t == Lex::End) {
+      break;
+    }
+    if (t == Lex::Error) {
+      _err = lex.takeLastError();
+      break;
+    }
+  }
+}
+
+
+bool TokStream::value(uint32_t i, const char*& p, uint32_t& len) const {
+  auto it = std::lower_bound(_valTokens.begin(), _valTokens.end(), i);
+  if (it == _valTokens.end() || *it != i) {
+    return false;
+  }
+  size_t vi = it - _valTokens.begin();
+  uint32_t start = _valOffsets[vi];
+  uint32_t end = (vi + 1 < _valOffsets.size()) ? _valOffsets[vi + 1] :
+                                                 (uint32_t)_valBytes.size();
+  p = _valBytes.data() + start;
+  len = end - start;
+  return true;
+}
+
+// -----------------------------------------------------------------------------------------------
+
+TokReader::TokReader(TokStream&& s) : _s{std::move(s)} {}
+
+
+void TokReader::load(uint32_t i) {
+  _tok = _s.kind(i);
+  _loc = _s.srcLoc(i);
+  _strvalValid = false;
+}
+
+
+bool TokReader::isValid() const {
+  return _next < _s.size() && _s.kind(_next) != Lex::End;
+}
+
+
+Token TokReader::next() {
+  if (_s.size() == 0) {
+    return _tok; // empty stream
+  }
+  _cur = _next;
+  if (_next + 1 < _s.size()) {
+    ++_next;
+  }
+  _undone = false;
+  load(_cur);
+  return _tok;
+}
+
+
+void TokReader::undoCurrent() {
+  if (!_undone) {
+    _next = _cur;
+    _undone = true;
+  }
+}
+
+
+Token TokReader::queuedToken() const {
+  if (_undone) {
+    return _tok;
+  }
+  // Tokens which the lexer produces together, like an automatically inserted
+  // ";" and the newline that caused it, share the same source offset. Lex
+  // would have the second token queued after returning the first one.
+  if (_next != _cur && _s.offset(_next) == _s.offset(_cur)) {
+    return _s.kind(_next);
+  }
+  return Lex::Error;
+}
+
+
+Token TokReader::peek(uint32_t n) const {
+  if (_s.size() == 0) {
+    return Lex::End;
+  }
+  uint32_t i = std::min(_next + n, _s.size() - 1);
+  return _s.kind(i);
+}
+
+
+uint32_t TokReader::nextOffset() const {
+  return _s.size() == 0 ? 0 : _s.offset(_next);
+}
+
+
+void TokReader::restoreSnapshot(const Snapshot& snapshot) {
+  _cur = snapshot.cur;
+  _next = snapshot.next;
+  _undone = snapshot.undone;
+  if (_s.size() != 0) {
+    load(_cur);
+  }
+  _backtracks++;
+}
+
+
+const char* TokReader::byteTokValue(size_t& z) const {
+  z = _loc.length;
+  return _s.src() + _loc.offset;
+}
+
+
+string TokReader::byteStringTokValue() const {
+  return {_s.src() + _loc.offset, _loc.length};
+}
+
+
+void TokReader::copyTokValue(string& s) const {
+  s.assign(_s.src() + _loc.offset, _loc.length);
+}
+
+
+const string& TokReader::interpretedTokValue() const {
+  if (!_strvalValid) {
+    const char* p;
+    uint32_t len;
+    if (_s.size() != 0 && _s.value(_cur, p, len)) {
+      _strval.assign(p, len);
+    } else {
+      _strval.clear();
+    }
+    _strvalValid = true;
+  }
+  return _strval;
+}
+
+
+uint32_t TokReader::tokHash() const {
+  if ((_tok == Lex::Identifier || Lex::isKeyword(_tok)) && _s.size() != 0) {
+    return _s.hash(_cur);
+  }
+  return IStr::hash(_s.src() + _loc.offset, _loc.length);
+}
+
+
+int TokReader::tokValueCmp(const char* p, size_t len) const {
+  if (_loc.length == len) {
+    return memcmp(p, _s.src() + _loc.offset, len);
+  }
+  return len < _loc.length ? -1 : 1;
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include "lex.h"
+#include "error.h"
+#include "srcloc.h"
+#include <vector>
+#include <string>
+
+// TokStream is the result of lexing an entire source file up front.
+//
+// Tokens are stored as a struct of arrays: an 8-bit kind and 32-bit offset,
+// length and identifier hash per token. Interpreted values of literals (which most tokens
+// don't have) are stored on the side, sorted by token index. Lexing stops at
+// the first error, in which case the last token of the stream is Lex::Error
+// and err() describes the error. Otherwise the last token is Lex::End.
+//
+// Token offsets are always relative to the start of the source, even when
+// only a range of it is lexed.
+//
+// A TokStream only refers to the source, it does not own it. Since it's a
+// plain value it can be produced on another thread or cached.
+//
+struct TokStream {
+  using Token = Lex::Token;
+
+  TokStream() {}
+  TokStream(const char* src, size_t len); // lexes all of src
+  TokStream(const char* src, size_t len, const SrcLoc& range); // lexes only range of src
+  TokStream(TokStream&&) = default;
+  TokStream& operator=(TokStream&&) = default;
+
+  uint32_t size() const { return (uint32_t)_kinds.size(); }
+  Token    kind(uint32_t i) const { return unpackKind(_kinds[i]); }
+  uint32_t offset(uint32_t i) const { return _offsets[i]; }
+  uint32_t length(uint32_t i) const { return _lengths[i]; }
+  SrcLoc   srcLoc(uint32_t i) const { return {_offsets[i], _lengths[i]}; }
+  uint32_t hash(uint32_t i) const { return _hashes[i]; } // IStr::hash of identifiers and keywords
+
+  // Interpreted value of the literal at token i. Returns false if the token
+  // doesn't have one, in which case its byte value should be used.
+  bool value(uint32_t i, const char*& p, uint32_t& len) const;
+
+  const char* src() const { return _src; }
+  size_t srcSize() const { return _srclen; }
+  const Err& err() const { return _err; }
+  Err&& takeErr() { return std::move(_err); }
+
+  // Compact token kinds: ASCII tokens are stored as-is and Lex::Tokens are
+  // stored as 0x80 + their index.
+  static uint8_t packKind(Token);
+  static Token unpackKind(uint8_t);
+
+private:
+  TokStream(const TokStream&) = delete;
+  void lex(uint32_t begin, uint32_t end);
+
+  const char*           _src = nullptr;
+  size_t                _srclen = 0;
+  std::vector<uint8_t>  _kinds;
+  std::vector<uint32_t> _offsets;
+  std::vector<uint32_t> _lengths;
+  std::vector<uint32_t> _hashes;     // IStr::hash of identifiers and keywords, else 0
+  std::vector<uint32_t> _valTokens;  // tokens that have an interpreted value
+  std::vector<uint32_t> _valOffsets; // start of each value in _valBytes
+  std::string           _valBytes;
+  Err                   _err;
+};
+
+
+// TokReader reads a TokStream through the same interface as Lex, so that a
+// pre-lexed stream can be consumed by code written against Lex::Token.
+// In addition, any upcoming token can be inspected with peek().
+struct TokReader {
+  using Token = Lex::Token;
+
+  TokReader(TokStream&&);
+
+  bool isValid() const;
+  const Err& lastError() const { return _s.err(); }
+  Err&& takeLastError() { return _s.takeErr(); }
+
+  Token next();
+  Token current() const { return _tok; }
+
+  // Like Lex::undoCurrent and Lex::queuedToken
+  void undoCurrent();
+  Token queuedToken() const;
+
+  // Returns the kind of the nth upcoming token without advancing.
+  // Returns the last token of the stream (End or Error) when n is past it.
+  Token peek(uint32_t n=0) const;
+
+  // Source offset of the token that the next call to next() returns
+  uint32_t nextOffset() const;
+
+  const char* byteTokValue(size_t&) const;
+  std::string byteStringTokValue() const;
+  void copyTokValue(std::string& s) const;
+  const std::string& interpretedTokValue() const;
+  uint32_t tokHash() const;
+
+  int tokValueCmp(const char* str, size_t len) const;
+  template<size_t N> int tokValueCmp(char const(&str)[N]) {
+    return tokValueCmp(str, N-1);
+  }
+
+  const SrcLoc& srcLoc() const { return _loc; }
+
+  // Snapshots are simply positions in the stream
+  struct Snapshot { uint32_t cur, next; bool undone; };
+  Snapshot createSnapshot() const { return {_cur, _next, _undone}; }
+  void restoreSnapshot(const Snapshot&);
+
+  // Number of times a snapshot has been restored, as Lex::backtrackCount
+  uint64_t backtrackCount() const { return _backtracks; }
+
+  const TokStream& stream() const { return _s; }
+
+private:
+  void load(uint32_t i);
+
+  TokStream   _s;
+  uint32_t    _cur = 0;   // index of current token
+  uint32_t    _next = 0;  // index of the token returned by the next call to next()
+  bool        _undone = false;
+  Token       _tok = Lex::End;
+  SrcLoc      _loc;
+  uint64_t    _backtracks = 0;
+  mutable std::string _strval; // interpreted value of current token
+  mutable bool        _strvalValid = false;
+};
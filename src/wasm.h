@@ -352,6 +352,10 @@ struct Buf {
   byte* data() {
     return startp;
   }
+
+  const byte* data() const {
+    return startp;
+  }
   
   void clear() {
     p = startp;